@@ -0,0 +1,172 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+// Сопрограммы C++20 поверх ThreadPool и ScheduledExecutor. Остальные
+// заголовки собираются в C++11, поэтому этот подключается только там,
+// где компилятор поддерживает сопрограммы.
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include "Future.h"
+
+template<typename T = void>
+class Task;
+
+namespace detail {
+
+template<typename T>
+class TaskPromiseBase {
+public:
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	// Завершившаяся задача сразу передает управление ожидающей
+	// сопрограмме (симметричная передача), без очереди пула и без роста
+	// стека.
+	struct FinalAwaiter {
+		bool await_ready() const noexcept { return false; }
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+			std::coroutine_handle<> next = handle.promise().continuation;
+			return next ? next : std::noop_coroutine();
+		}
+		void await_resume() const noexcept { }
+	};
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { error = std::current_exception(); }
+
+	std::coroutine_handle<> continuation;
+protected:
+	void check() {
+		if (error)
+			std::rethrow_exception(error);
+	}
+	std::exception_ptr error;
+};
+
+template<typename T>
+class TaskPromise : public TaskPromiseBase<T> {
+public:
+	Task<T> get_return_object();
+	template<typename U>
+	void return_value(U&& value) { result.emplace(std::forward<U>(value)); }
+	T take() {
+		this->check();
+		return result.take();
+	}
+private:
+	ResultStorage<T> result;
+};
+
+template<>
+class TaskPromise<void> : public TaskPromiseBase<void> {
+public:
+	Task<void> get_return_object();
+	void return_void() { }
+	void take() { check(); }
+};
+
+// Сопрограмма, которая запускается сразу и уничтожает себя сама по
+// завершении. Через нее Task запускается из обычного кода.
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() { }
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+template<typename T>
+Detached run_task(Task<T> task, Promise<T> promise);
+inline Detached run_task(Task<void> task, Promise<void> promise);
+
+}
+
+// Ленивая сопрограмма с результатом T. Тело начинает выполняться,
+// когда задачу ждут через co_await, и в том же потоке. Когда тело
+// завершается, ожидающая сопрограмма продолжается прямо в потоке, где
+// это произошло, например в потоке пула после co_await pool.schedule().
+// Исключение из тела бросается из co_await. Результат можно забрать
+// один раз.
+template<typename T>
+class Task {
+public:
+	typedef detail::TaskPromise<T> promise_type;
+
+	Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) { }
+	Task & operator = (Task&& other) noexcept {
+		if (this != &other) {
+			if (handle)
+				handle.destroy();
+			handle = std::exchange(other.handle, nullptr);
+		}
+		return *this;
+	}
+	Task(Task const &) = delete;
+	Task & operator = (Task const &) = delete;
+	~Task() {
+		if (handle)
+			handle.destroy();
+	}
+
+	bool await_ready() const noexcept { return handle.done(); }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+		handle.promise().continuation = awaiter;
+		return handle;
+	}
+	T await_resume() { return handle.promise().take(); }
+
+	// Запускает задачу из обычного кода в вызывающем потоке до первой
+	// приостановки. Результат передается через Future; его можно
+	// дождаться или продолжить через then.
+	Future<T> start(Executor executor = Executor()) && {
+		Promise<T> promise;
+		Future<T> res = promise.get_future(executor);
+		detail::run_task(std::move(*this), std::move(promise));
+		return res;
+	}
+private:
+	friend class detail::TaskPromise<T>;
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) { }
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+template<typename T>
+Detached run_task(Task<T> task, Promise<T> promise) {
+	try {
+		promise.set_value(co_await task);
+	} catch (...) {
+		promise.set_exception(std::current_exception());
+	}
+}
+
+inline Detached run_task(Task<void> task, Promise<void> promise) {
+	try {
+		co_await task;
+		promise.set_value();
+	} catch (...) {
+		promise.set_exception(std::current_exception());
+	}
+}
+
+}
+
+#endif
+#endif
+
+#endif
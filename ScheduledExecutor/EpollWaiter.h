@@ -0,0 +1,134 @@
+#ifndef EPOLL_WAITER_H
+#define EPOLL_WAITER_H
+
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <system_error>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// Ожидание диспетчера ScheduledExecutor на epoll. Срок ближайшего
+// таймера взводится в timerfd по CLOCK_MONOTONIC - тем же часам, что у
+// steady_clock, - а другие потоки будят диспетчер записью в eventfd.
+// Счетчик eventfd не теряет запись, сделанную до epoll_wait, поэтому
+// ждать можно без мьютекса. В тот же epoll добавляются дескрипторы
+// пользователя; каждый взводится с EPOLLONESHOT и после срабатывания
+// молчит, пока его не взведут снова через rearm.
+class EpollWaiter {
+public:
+	EpollWaiter() : epoll(-1), timer(-1), event(-1) {
+		try {
+			epoll = check(epoll_create1(EPOLL_CLOEXEC), "epoll_create1");
+			timer = check(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), "timerfd_create");
+			event = check(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), "eventfd");
+			control(EPOLL_CTL_ADD, timer, EPOLLIN);
+			control(EPOLL_CTL_ADD, event, EPOLLIN);
+		} catch (...) {
+			close_all();
+			throw;
+		}
+	}
+	~EpollWaiter() { close_all(); }
+	EpollWaiter(EpollWaiter const &) = delete;
+	EpollWaiter & operator = (EpollWaiter const &) = delete;
+
+	// Взводит timerfd на момент deadline или снимает его, если deadline
+	// равен time_point::max().
+	void arm(std::chrono::steady_clock::time_point deadline) {
+		itimerspec spec = itimerspec();
+		if (deadline != std::chrono::steady_clock::time_point::max()) {
+			auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+			// Нулевое значение снимает таймер, а прошедший срок должен
+			// сработать сразу.
+			if (ns <= 0)
+				ns = 1;
+			spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+			spec.it_value.tv_nsec = static_cast<long>(ns % 1000000000);
+		}
+		check(timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, nullptr), "timerfd_settime");
+	}
+	void wake() {
+		uint64_t one = 1;
+		ssize_t res = ::write(event, &one, sizeof(one));
+		(void)res;
+	}
+	// Ждет срабатывания таймера, пробуждения или готовности дескрипторов
+	// пользователя и дописывает готовые дескрипторы в ready парами
+	// (fd, события).
+	void wait(std::vector<std::pair<int, uint32_t>> & ready) {
+		epoll_event events[max_events];
+		int n = epoll_wait(epoll, events, max_events, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				return;
+			check(n, "epoll_wait");
+		}
+		for (int i = 0; i < n; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == timer || fd == event)
+				drain(fd);
+			else
+				ready.push_back(std::make_pair(fd, static_cast<uint32_t>(events[i].events)));
+		}
+	}
+
+	void add(int fd, uint32_t events) { control(EPOLL_CTL_ADD, fd, events | EPOLLONESHOT); }
+	void rearm(int fd, uint32_t events) { control(EPOLL_CTL_MOD, fd, events | EPOLLONESHOT); }
+	void remove(int fd) { control(EPOLL_CTL_DEL, fd, 0); }
+private:
+	static const int max_events = 64;
+
+	static int check(int res, char const * what) {
+		if (res < 0)
+			throw std::system_error(errno, std::system_category(), what);
+		return res;
+	}
+	void control(int op, int fd, uint32_t events) {
+		epoll_event ev = epoll_event();
+		ev.events = events;
+		ev.data.fd = fd;
+		check(epoll_ctl(epoll, op, fd, &ev), "epoll_ctl");
+	}
+	static void drain(int fd) {
+		uint64_t value;
+		ssize_t res = ::read(fd, &value, sizeof(value));
+		(void)res;
+	}
+	void close_all() {
+		int fds[] = { event, timer, epoll };
+		for (int fd : fds)
+			if (fd >= 0)
+				::close(fd);
+	}
+
+	int epoll;
+	int timer;
+	int event;
+};
+
+#else
+
+#include <stdexcept>
+
+// Без epoll такой диспетчер построить нельзя.
+class EpollWaiter {
+public:
+	EpollWaiter() { throw std::runtime_error("EpollWaiter requires Linux."); }
+	void arm(std::chrono::steady_clock::time_point) { }
+	void wake() { }
+	void wait(std::vector<std::pair<int, uint32_t>> &) { }
+	void add(int, uint32_t) { }
+	void rearm(int, uint32_t) { }
+	void remove(int) { }
+};
+
+#endif
+#endif
@@ -0,0 +1,499 @@
+#ifndef FUTURE_H
+#define FUTURE_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include <type_traits>
+#include "TaskFunction.h"
+
+// Пул блоков одного размера для объектов типа T. Блоки берутся из
+// кэша текущего потока, а он пополняется из общего списка пачками,
+// поэтому в установившемся режиме выделение не обращается к куче и
+// почти никогда не берет общий мьютекс.
+template<typename T>
+class SlabPool {
+public:
+	static void* allocate() {
+		Cache& local = cache();
+		if (!local.free)
+			refill(local);
+		Node* node = local.free;
+		local.free = node->next;
+		--local.count;
+		return &node->storage;
+	}
+	static void deallocate(void* p) {
+		Cache& local = cache();
+		Node* node = static_cast<Node*>(p);
+		node->next = local.free;
+		local.free = node;
+		if (++local.count > cache_limit)
+			drain(local, cache_limit / 2);
+	}
+private:
+	union Node {
+		Node* next;
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+	};
+	static const size_t slab_size = 64;
+	static const size_t cache_limit = 256;
+
+	struct Global {
+		std::mutex mutex;
+		Node* free = nullptr;
+		std::vector<std::unique_ptr<Node[]>> slabs;
+	};
+	struct Cache {
+		Node* free = nullptr;
+		size_t count = 0;
+		~Cache() { drain(*this, count); }
+	};
+	static Global& global() {
+		static Global pool;
+		return pool;
+	}
+	static Cache& cache() {
+		static thread_local Cache local;
+		return local;
+	}
+
+	static void refill(Cache& local) {
+		Global& pool = global();
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		if (!pool.free) {
+			Node* slab = new Node[slab_size];
+			pool.slabs.emplace_back(slab);
+			for (size_t i = 0; i < slab_size; ++i) {
+				slab[i].next = pool.free;
+				pool.free = &slab[i];
+			}
+		}
+		for (size_t i = 0; i < slab_size && pool.free; ++i) {
+			Node* node = pool.free;
+			pool.free = node->next;
+			node->next = local.free;
+			local.free = node;
+			++local.count;
+		}
+	}
+	static void drain(Cache& local, size_t n) {
+		Global& pool = global();
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		for (; n && local.free; --n) {
+			Node* node = local.free;
+			local.free = node->next;
+			--local.count;
+			node->next = pool.free;
+			pool.free = node;
+		}
+	}
+};
+
+template<typename T>
+struct ResultStorage {
+	ResultStorage() : constructed(false) { }
+	~ResultStorage() {
+		if (constructed)
+			get().~T();
+	}
+	template<typename... U>
+	void emplace(U&&... value) {
+		::new (static_cast<void*>(&data)) T(std::forward<U>(value)...);
+		constructed = true;
+	}
+	T take() { return std::move(get()); }
+	T& get() { return *reinterpret_cast<T*>(&data); }
+private:
+	typename std::aligned_storage<sizeof(T), alignof(T)>::type data;
+	bool constructed;
+};
+
+template<>
+struct ResultStorage<void> {
+	void emplace() { }
+	void take() { }
+	void get() { }
+};
+
+// Куда ставить продолжения готового Future: обычно пул, который
+// выполнил задачу. Без исполнителя продолжение выполняется сразу в
+// потоке, который завершил задачу.
+struct Executor {
+	void* context = nullptr;
+	void (*post)(void*, TaskFunction&&) = nullptr;
+
+	explicit operator bool() const { return post != nullptr; }
+	void operator()(TaskFunction&& task) const { post(context, std::move(task)); }
+};
+
+// Общее состояние пары Promise/Future. Живет в SlabPool, а не в куче,
+// и освобождается, когда его отпускает последний владелец.
+template<typename T>
+class SharedState {
+public:
+	static SharedState* create() {
+		return ::new (SlabPool<SharedState>::allocate()) SharedState;
+	}
+	void add_ref() { refs.fetch_add(1, std::memory_order_relaxed); }
+	void release() {
+		if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			this->~SharedState();
+			SlabPool<SharedState>::deallocate(this);
+		}
+	}
+
+	template<typename... U>
+	void set_value(U&&... value) {
+		result.emplace(std::forward<U>(value)...);
+		publish();
+	}
+	void set_exception(std::exception_ptr e) {
+		error = e;
+		publish();
+	}
+
+	bool is_ready() const { return ready.load(std::memory_order_acquire); }
+	void wait() {
+		if (is_ready())
+			return;
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [this] { return is_ready(); });
+	}
+	template<typename Clock, typename Duration>
+	bool wait_until(std::chrono::time_point<Clock, Duration> const & time) {
+		if (is_ready())
+			return true;
+		std::unique_lock<std::mutex> lock(mutex);
+		return condition.wait_until(lock, time, [this] { return is_ready(); });
+	}
+	T take() {
+		if (error)
+			std::rethrow_exception(error);
+		return result.take();
+	}
+	// Обратный вызов выполняется в потоке, который сделал состояние
+	// готовым, или сразу, если оно уже готово.
+	void on_ready(TaskFunction callback) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!is_ready()) {
+			if (callbacks)
+				callbacks = Chain {std::move(callbacks), std::move(callback)};
+			else
+				callbacks = std::move(callback);
+			return;
+		}
+		lock.unlock();
+		callback();
+	}
+private:
+	struct Chain {
+		TaskFunction first;
+		TaskFunction second;
+		void operator()() {
+			first();
+			second();
+		}
+	};
+
+	SharedState() : refs(1), ready(false) { }
+	void publish() {
+		TaskFunction ready_callbacks;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			ready.store(true, std::memory_order_release);
+			ready_callbacks = std::move(callbacks);
+		}
+		condition.notify_all();
+		if (ready_callbacks)
+			ready_callbacks();
+	}
+
+	std::atomic<int> refs;
+	std::atomic<bool> ready;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::exception_ptr error;
+	ResultStorage<T> result;
+	TaskFunction callbacks;
+};
+
+// Аналог std::future для задач пула: общее состояние берется из
+// SlabPool, поэтому получение результата не требует выделения памяти.
+// Future, полученный от пула, помнит его и ставит туда продолжения.
+template<typename T>
+class Future {
+public:
+	Future() noexcept : state(nullptr) { }
+	explicit Future(SharedState<T>* state, Executor executor = Executor()) noexcept
+		: state(state), executor(executor) { }
+	Future(Future&& other) noexcept : state(other.state), executor(other.executor) {
+		other.state = nullptr;
+	}
+	Future& operator = (Future&& other) noexcept {
+		if (this != &other) {
+			if (state)
+				state->release();
+			state = other.state;
+			executor = other.executor;
+			other.state = nullptr;
+		}
+		return *this;
+	}
+	Future(Future const &) = delete;
+	Future& operator = (Future const &) = delete;
+	~Future() {
+		if (state)
+			state->release();
+	}
+
+	bool valid() const noexcept { return state != nullptr; }
+	bool is_ready() const { return check().is_ready(); }
+	Executor get_executor() const { return executor; }
+	void wait() const { check().wait(); }
+	template<typename Rep, typename Period>
+	std::future_status wait_for(std::chrono::duration<Rep, Period> const & duration) const {
+		return wait_until(std::chrono::steady_clock::now() + duration);
+	}
+	template<typename Clock, typename Duration>
+	std::future_status wait_until(std::chrono::time_point<Clock, Duration> const & time) const {
+		return check().wait_until(time) ? std::future_status::ready : std::future_status::timeout;
+	}
+	// Как и std::future::get, забирает результат и делает объект невалидным.
+	T get() {
+		check().wait();
+		Holder holder(state);
+		state = nullptr;
+		return holder.state->take();
+	}
+
+	// Когда результат будет готов, ставит fn(Future<T>) в исполнитель
+	// этого Future и возвращает Future для результата fn. Ни один поток
+	// при этом не ждет. Сам объект становится невалидным.
+	template<typename Fn>
+	auto then(Fn&& fn)
+		->Future<typename std::result_of<typename std::decay<Fn>::type(Future<T>)>::type>;
+	// Легковесный обратный вызов в потоке, завершившем задачу (или сразу,
+	// если результат уже готов). Для тяжелой работы используйте then.
+	void on_ready(TaskFunction callback) { check().on_ready(std::move(callback)); }
+private:
+	struct Holder {
+		explicit Holder(SharedState<T>* state) : state(state) { }
+		~Holder() { state->release(); }
+		SharedState<T>* state;
+	};
+	SharedState<T>& check() const {
+		if (!state)
+			throw std::future_error(std::future_errc::no_state);
+		return *state;
+	}
+
+	SharedState<T>* state;
+	Executor executor;
+};
+
+template<typename T>
+class Promise {
+public:
+	Promise() : state(SharedState<T>::create()), retrieved(false), satisfied(false) { }
+	Promise(Promise&& other) noexcept
+		: state(other.state), retrieved(other.retrieved), satisfied(other.satisfied) {
+		other.state = nullptr;
+	}
+	Promise(Promise const &) = delete;
+	Promise& operator = (Promise const &) = delete;
+	Promise& operator = (Promise&& other) noexcept {
+		if (this != &other) {
+			abandon();
+			state = other.state;
+			retrieved = other.retrieved;
+			satisfied = other.satisfied;
+			other.state = nullptr;
+		}
+		return *this;
+	}
+	~Promise() { abandon(); }
+
+	Future<T> get_future(Executor executor = Executor()) {
+		if (retrieved)
+			throw std::future_error(std::future_errc::future_already_retrieved);
+		retrieved = true;
+		state->add_ref();
+		return Future<T>(state, executor);
+	}
+	template<typename... U>
+	void set_value(U&&... value) {
+		satisfy();
+		state->set_value(std::forward<U>(value)...);
+	}
+	void set_exception(std::exception_ptr e) {
+		satisfy();
+		state->set_exception(e);
+	}
+private:
+	void abandon() noexcept {
+		if (!state)
+			return;
+		if (!satisfied)
+			state->set_exception(std::make_exception_ptr(
+				std::future_error(std::future_errc::broken_promise)));
+		state->release();
+		state = nullptr;
+	}
+	void satisfy() {
+		if (satisfied)
+			throw std::future_error(std::future_errc::promise_already_satisfied);
+		satisfied = true;
+	}
+
+	SharedState<T>* state;
+	bool retrieved;
+	bool satisfied;
+};
+
+// Функтор и обещание для его результата в одном объекте; кладется в
+// очередь пула целиком, без дополнительной обертки.
+template<typename R, typename Fn>
+class PackagedTask {
+public:
+	template<typename F>
+	PackagedTask(Promise<R>&& promise, F&& fn) : promise(std::move(promise)), fn(std::forward<F>(fn)) { }
+	PackagedTask(PackagedTask&&) = default;
+	void operator()() {
+		try {
+			run(std::is_void<R>());
+		} catch (...) {
+			promise.set_exception(std::current_exception());
+		}
+	}
+private:
+	void run(std::false_type) { promise.set_value(fn()); }
+	void run(std::true_type) {
+		fn();
+		promise.set_value();
+	}
+
+	Promise<R> promise;
+	Fn fn;
+};
+
+template<typename R, typename Fn>
+PackagedTask<R, typename std::decay<Fn>::type> make_packaged_task(Promise<R>&& promise, Fn&& fn) {
+	return PackagedTask<R, typename std::decay<Fn>::type>(std::move(promise), std::forward<Fn>(fn));
+}
+
+// Продолжение then: вызывает fn с готовым Future предшественника.
+template<typename T, typename Fn>
+struct ThenCall {
+	Fn fn;
+	Future<T> source;
+	auto operator()() -> typename std::result_of<Fn(Future<T>)>::type {
+		return fn(std::move(source));
+	}
+};
+
+// Переставляет задачу в исполнитель, если он есть.
+template<typename Task>
+struct Scheduled {
+	Executor executor;
+	Task task;
+	void operator()() {
+		if (executor)
+			executor(TaskFunction(std::move(task)));
+		else
+			task();
+	}
+};
+
+template<typename T>
+template<typename Fn>
+auto Future<T>::then(Fn&& fn)
+-> Future<typename std::result_of<typename std::decay<Fn>::type(Future<T>)>::type> {
+	typedef typename std::decay<Fn>::type Callable;
+	typedef typename std::result_of<Callable(Future<T>)>::type R;
+	typedef PackagedTask<R, ThenCall<T, Callable>> Task;
+
+	SharedState<T>& source = check();
+	Promise<R> promise;
+	Future<R> res = promise.get_future(executor);
+	Executor target = executor;
+	Task task(std::move(promise), ThenCall<T, Callable> {std::forward<Fn>(fn), std::move(*this)});
+	source.on_ready(Scheduled<Task> {target, std::move(task)});
+	return res;
+}
+
+template<typename T>
+struct WhenAnyResult {
+	size_t index;
+	std::vector<Future<T>> futures;
+};
+
+// Future, который становится готовым, когда готовы все futures.
+// Результат - те же Future, уже готовые.
+template<typename T>
+Future<std::vector<Future<T>>> when_all(std::vector<Future<T>> futures) {
+	struct State {
+		std::vector<Future<T>> futures;
+		Promise<std::vector<Future<T>>> promise;
+		std::atomic<size_t> remaining;
+		void arrive() {
+			if (--remaining == 0)
+				promise.set_value(std::move(futures));
+		}
+	};
+	std::shared_ptr<State> state = std::make_shared<State>();
+	Future<std::vector<Future<T>>> res = state->promise.get_future(
+		futures.empty() ? Executor() : futures.front().get_executor());
+	// Лишняя единица не дает завершить ожидание, пока не подписаны все.
+	state->remaining = futures.size() + 1;
+	state->futures = std::move(futures);
+	for (Future<T>& future : state->futures)
+		future.on_ready([state] { state->arrive(); });
+	state->arrive();
+	return res;
+}
+
+// Future, который становится готовым, когда готов хотя бы один из
+// futures. index - номер первого готового (или size_t(-1) для пустого
+// списка).
+template<typename T>
+Future<WhenAnyResult<T>> when_any(std::vector<Future<T>> futures) {
+	struct State {
+		std::vector<Future<T>> futures;
+		Promise<WhenAnyResult<T>> promise;
+		std::atomic<bool> fired;
+		std::atomic<size_t> index;
+		// Результат отдает второй из двух: первый готовый Future или
+		// поток, закончивший подписку.
+		std::atomic<int> gate;
+		void arrive() {
+			if (--gate == 0)
+				promise.set_value(WhenAnyResult<T> {index, std::move(futures)});
+		}
+	};
+	std::shared_ptr<State> state = std::make_shared<State>();
+	Future<WhenAnyResult<T>> res = state->promise.get_future(
+		futures.empty() ? Executor() : futures.front().get_executor());
+	state->fired = false;
+	state->index = size_t(-1);
+	state->gate = futures.empty() ? 1 : 2;
+	state->futures = std::move(futures);
+	for (size_t i = 0; i < state->futures.size(); ++i)
+		state->futures[i].on_ready([state, i] {
+			if (!state->fired.exchange(true)) {
+				state->index = i;
+				state->arrive();
+			}
+		});
+	state->arrive();
+	return res;
+}
+
+#endif
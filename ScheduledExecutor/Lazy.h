@@ -0,0 +1,147 @@
+#ifndef LAZY_H
+#define LAZY_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include "Future.h"
+
+// Общее состояние Lazy: функтор, его результат или исключение и этап
+// вычисления. Этап меняется только вперед - idle, running, done, - и
+// перейти из idle в running может лишь один поток, так что функтор
+// вызывается не больше одного раза.
+template<typename T>
+class LazyState {
+public:
+	typedef typename std::conditional<std::is_void<T>::value, void,
+		typename std::add_lvalue_reference<typename std::add_const<T>::type>::type>::type Result;
+
+	virtual ~LazyState() { }
+	LazyState(LazyState const &) = delete;
+	LazyState & operator = (LazyState const &) = delete;
+
+	bool is_started() const { return phase.load(std::memory_order_acquire) != idle; }
+	bool is_ready() const { return phase.load(std::memory_order_acquire) == done; }
+	// Вычисляет результат в вызывающем потоке, если вычисление еще никто
+	// не начал. Возвращает false, если его уже начал другой поток.
+	bool run() {
+		int expected = idle;
+		if (!phase.compare_exchange_strong(expected, running, std::memory_order_acq_rel))
+			return false;
+		try {
+			compute();
+		} catch (...) {
+			error = std::current_exception();
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			phase.store(done, std::memory_order_release);
+		}
+		condition.notify_all();
+		return true;
+	}
+	// Берет вычисление на себя, а если его уже ведет другой поток,
+	// ждет, пока тот закончит.
+	void wait() {
+		if (is_ready() || run())
+			return;
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [this] { return is_ready(); });
+	}
+	Result get() {
+		wait();
+		if (error)
+			std::rethrow_exception(error);
+		return result.get();
+	}
+protected:
+	LazyState() : phase(idle) { }
+	virtual void compute() = 0;
+
+	ResultStorage<T> result;
+private:
+	enum { idle, running, done };
+
+	std::atomic<int> phase;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::exception_ptr error;
+};
+
+template<typename T, typename Fn>
+class LazyTask : public LazyState<T> {
+public:
+	template<typename F>
+	explicit LazyTask(F&& fn) : fn(std::forward<F>(fn)) { }
+private:
+	void compute() override { store(std::is_void<T>()); }
+	void store(std::false_type) { this->result.emplace(fn()); }
+	void store(std::true_type) { fn(); }
+
+	Fn fn;
+};
+
+// Ленивое значение: функтор вызывается при первом get() в потоке,
+// который его вызвал, а результат запоминается и достается всем копиям
+// объекта по константной ссылке. Потоки, вызвавшие get() во время
+// вычисления, ждут его, а не считают заново. Исключение функтора тоже
+// запоминается и бросается из каждого get(). Вычисление можно начать
+// заранее в другом потоке через runner(), тогда get() часто
+// возвращает готовый результат сразу.
+template<typename T>
+class Lazy {
+public:
+	typedef typename LazyState<T>::Result Result;
+
+	// Функтор, который начинает вычисление, если его еще никто не
+	// начал. Состояние он держит слабой ссылкой: если все копии Lazy
+	// уничтожены раньше, чем он выполнился, результат уже никому не нужен.
+	class Runner {
+	public:
+		explicit Runner(std::weak_ptr<LazyState<T>> state) : state(std::move(state)) { }
+		void operator()() const {
+			if (std::shared_ptr<LazyState<T>> alive = state.lock())
+				alive->run();
+		}
+	private:
+		std::weak_ptr<LazyState<T>> state;
+	};
+
+	Lazy() = default;
+	explicit Lazy(std::shared_ptr<LazyState<T>> state) : state(std::move(state)) { }
+
+	bool valid() const noexcept { return state != nullptr; }
+	bool is_started() const { return check().is_started(); }
+	bool is_ready() const { return check().is_ready(); }
+	void wait() const { check().wait(); }
+	// В отличие от Future::get, не забирает результат: его можно
+	// получать сколько угодно раз из любых копий.
+	Result get() const { return check().get(); }
+	bool run() const { return check().run(); }
+	Runner runner() const {
+		check();
+		return Runner(state);
+	}
+private:
+	LazyState<T>& check() const {
+		if (!state)
+			throw std::future_error(std::future_errc::no_state);
+		return *state;
+	}
+
+	std::shared_ptr<LazyState<T>> state;
+};
+
+template<typename Fn>
+Lazy<typename std::result_of<typename std::decay<Fn>::type()>::type> make_lazy(Fn&& fn) {
+	typedef typename std::decay<Fn>::type Callable;
+	typedef typename std::result_of<Callable()>::type R;
+	return Lazy<R>(std::make_shared<LazyTask<R, Callable>>(std::forward<Fn>(fn)));
+}
+
+#endif
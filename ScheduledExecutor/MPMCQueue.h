@@ -0,0 +1,106 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+// Ограниченная lock-free очередь для многих производителей и многих
+// потребителей (Д. Вьюков). Каждая ячейка хранит номер последовательности,
+// по которому производитель и потребитель понимают, чья сейчас очередь
+// писать в ячейку, так что на быстром пути нет ни одного мьютекса.
+template<typename T>
+class MPMCQueue {
+public:
+	explicit MPMCQueue(size_t capacity);
+	MPMCQueue(MPMCQueue const &) = delete;
+	MPMCQueue & operator = (MPMCQueue const &) = delete;
+
+	// Возвращают false, если очередь заполнена или пуста соответственно.
+	bool try_push(T&& value);
+	bool try_pop(T& value);
+
+	// Приблизительная проверка: ячейка может быть занята производителем,
+	// который еще не дописал в нее значение.
+	bool empty() const {
+		return dequeue_pos.load() == enqueue_pos.load();
+	}
+	// Приблизительное число элементов, с той же оговоркой.
+	size_t size() const {
+		size_t head = dequeue_pos.load();
+		size_t tail = enqueue_pos.load();
+		return tail > head ? tail - head : 0;
+	}
+	size_t capacity() const { return mask + 1; }
+private:
+	static const size_t cache_line = 64;
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> buffer;
+	size_t mask;
+	// Позиции разнесены по разным кэш-линиям, чтобы производители и
+	// потребители не мешали друг другу.
+	char pad0[cache_line];
+	std::atomic<size_t> enqueue_pos;
+	char pad1[cache_line - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> dequeue_pos;
+	char pad2[cache_line - sizeof(std::atomic<size_t>)];
+};
+
+template<typename T>
+MPMCQueue<T>::MPMCQueue(size_t capacity) : buffer(new Cell[capacity]), mask(capacity - 1) {
+	if (capacity < 2 || (capacity & (capacity - 1)))
+		throw std::invalid_argument("MPMCQueue capacity must be a power of two.");
+	for (size_t i = 0; i < capacity; ++i)
+		buffer[i].sequence.store(i, std::memory_order_relaxed);
+	enqueue_pos.store(0, std::memory_order_relaxed);
+	dequeue_pos.store(0, std::memory_order_relaxed);
+}
+
+template<typename T>
+bool MPMCQueue<T>::try_push(T&& value) {
+	size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+	for (;;) {
+		Cell& cell = buffer[pos & mask];
+		size_t seq = cell.sequence.load(std::memory_order_acquire);
+		intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+		if (diff == 0) {
+			if (enqueue_pos.compare_exchange_weak(pos, pos + 1)) {
+				cell.data = std::move(value);
+				cell.sequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+template<typename T>
+bool MPMCQueue<T>::try_pop(T& value) {
+	size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+	for (;;) {
+		Cell& cell = buffer[pos & mask];
+		size_t seq = cell.sequence.load(std::memory_order_acquire);
+		intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+		if (diff == 0) {
+			if (dequeue_pos.compare_exchange_weak(pos, pos + 1)) {
+				value = std::move(cell.data);
+				cell.sequence.store(pos + mask + 1, std::memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = dequeue_pos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+#endif
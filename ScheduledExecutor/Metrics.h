@@ -0,0 +1,128 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Счетчик с одним писателем. Писатель обновляет его обычными load и
+// store без атомарного чтения-модификации-записи, поэтому обновление
+// стоит как запись в память, а читатели из других потоков видят
+// согласованное, хотя, возможно, чуть устаревшее значение.
+class Counter {
+public:
+	Counter() : value(0) { }
+	void add(uint64_t n) {
+		value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	uint64_t get() const { return value.load(std::memory_order_relaxed); }
+private:
+	std::atomic<uint64_t> value;
+};
+
+// Лог-линейная гистограмма длительностей в наносекундах: каждая степень
+// двойки делится на sub_buckets равных корзин, так что относительная
+// ошибка не превышает 1 / sub_buckets на всем диапазоне uint64_t, а
+// запись - это поиск старшего бита и одна запись в память. Как и
+// Counter, пишется одним потоком.
+class Histogram {
+public:
+	static const unsigned sub_bits = 3;
+	static const uint64_t sub_buckets = uint64_t(1) << sub_bits;
+	static const size_t bucket_count = (64 - sub_bits + 1) * sub_buckets;
+
+	// Копия гистограммы, снятая без остановки писателя. Копии разных
+	// гистограмм складываются через merge.
+	class Snapshot {
+	public:
+		Snapshot() : counts(bucket_count, 0), total(0), sum(0), maximum(0) { }
+		void merge(Snapshot const & other) {
+			for (size_t i = 0; i < bucket_count; ++i)
+				counts[i] += other.counts[i];
+			total += other.total;
+			sum += other.sum;
+			maximum = std::max(maximum, other.maximum);
+		}
+		uint64_t count() const { return total; }
+		double mean() const { return total ? double(sum) / total : 0; }
+		uint64_t max() const { return maximum; }
+		// Верхняя граница корзины, в которую попал p-й процентиль (p от 0
+		// до 100), но не больше наибольшего записанного значения.
+		uint64_t percentile(double p) const {
+			if (!total)
+				return 0;
+			uint64_t rank = static_cast<uint64_t>(p / 100 * (total - 1)) + 1;
+			uint64_t seen = 0;
+			for (size_t i = 0; i < bucket_count; ++i) {
+				seen += counts[i];
+				if (seen >= rank)
+					return std::min(upper_bound(i), maximum);
+			}
+			return maximum;
+		}
+	private:
+		friend class Histogram;
+		std::vector<uint64_t> counts;
+		uint64_t total;
+		uint64_t sum;
+		uint64_t maximum;
+	};
+
+	Histogram() : counts(), sum(0), maximum(0) { }
+	Histogram(Histogram const &) = delete;
+	Histogram & operator = (Histogram const &) = delete;
+
+	void record(uint64_t value) {
+		bump(counts[index(value)], 1);
+		bump(sum, value);
+		if (value > maximum.load(std::memory_order_relaxed))
+			maximum.store(value, std::memory_order_relaxed);
+	}
+	template<typename Rep, typename Period>
+	void record(std::chrono::duration<Rep, Period> duration) {
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+		record(static_cast<uint64_t>(ns > 0 ? ns : 0));
+	}
+
+	// Добавляет содержимое гистограммы к snapshot. Корзины читаются по
+	// одной, так что при одновременной записи snapshot может не
+	// содержать самых последних значений.
+	void collect(Snapshot & snapshot) const {
+		uint64_t collected = 0;
+		for (size_t i = 0; i < bucket_count; ++i) {
+			uint64_t n = counts[i].load(std::memory_order_relaxed);
+			snapshot.counts[i] += n;
+			collected += n;
+		}
+		snapshot.total += collected;
+		snapshot.sum += sum.load(std::memory_order_relaxed);
+		snapshot.maximum = std::max(snapshot.maximum, maximum.load(std::memory_order_relaxed));
+	}
+
+	static size_t index(uint64_t value) {
+		if (value < sub_buckets)
+			return static_cast<size_t>(value);
+		unsigned exponent = 63 - __builtin_clzll(value);
+		unsigned shift = exponent - sub_bits;
+		return (shift + 1) * sub_buckets + static_cast<size_t>((value >> shift) - sub_buckets);
+	}
+	static uint64_t upper_bound(size_t index) {
+		if (index < sub_buckets)
+			return index;
+		unsigned shift = static_cast<unsigned>(index / sub_buckets) - 1;
+		uint64_t mantissa = index % sub_buckets + sub_buckets;
+		return ((mantissa + 1) << shift) - 1;
+	}
+private:
+	static void bump(std::atomic<uint64_t> & counter, uint64_t n) {
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	std::atomic<uint64_t> counts[bucket_count];
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> maximum;
+};
+
+#endif
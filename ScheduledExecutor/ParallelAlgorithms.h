@@ -0,0 +1,138 @@
+#ifndef PARALLEL_ALGORITHMS_H
+#define PARALLEL_ALGORITHMS_H
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <thread>
+#include "ThreadPool.h"
+
+// Параллельные алгоритмы поверх ThreadPool. Диапазон рекурсивно делится
+// пополам: правая половина ставится в пул, левая выполняется сразу.
+// Пока правая половина не готова, ждущий поток выполняет задачи из
+// пула, поэтому алгоритмы можно вызывать изнутри задач того же пула,
+// не рискуя занять все потоки ожиданием.
+
+namespace detail {
+
+// Размер куска по умолчанию: примерно восемь кусков на поток.
+inline size_t default_grain(ThreadPool const & pool, size_t n, size_t min_grain = 1) {
+	return std::max(min_grain, n / (pool.size() * 8));
+}
+
+// Выполняет left в текущем потоке и right в пуле и дожидается обоих.
+// Первое из исключений пробрасывается дальше.
+template<typename Left, typename Right>
+void fork_join(ThreadPool & pool, Left const & left, Right const & right) {
+	std::atomic<bool> done {false};
+	std::exception_ptr right_error;
+	pool.post_unbounded(ThreadPool::Priority::Normal, [&right, &right_error, &done] {
+		try {
+			right();
+		} catch (...) {
+			right_error = std::current_exception();
+		}
+		done.store(true, std::memory_order_release);
+	});
+	std::exception_ptr left_error;
+	try {
+		left();
+	} catch (...) {
+		left_error = std::current_exception();
+	}
+	while (!done.load(std::memory_order_acquire))
+		if (!pool.try_run_one())
+			std::this_thread::yield();
+	if (left_error)
+		std::rethrow_exception(left_error);
+	if (right_error)
+		std::rethrow_exception(right_error);
+}
+
+template<typename Index, typename Fn>
+void for_range(ThreadPool & pool, Index first, Index last, size_t grain, Fn const & fn) {
+	if (static_cast<size_t>(last - first) <= grain) {
+		for (; first != last; ++first)
+			fn(first);
+		return;
+	}
+	Index middle = first + (last - first) / 2;
+	fork_join(pool,
+		[&] { for_range(pool, first, middle, grain, fn); },
+		[&] { for_range(pool, middle, last, grain, fn); });
+}
+
+template<typename Index, typename T, typename Map, typename Reduce>
+T reduce_range(ThreadPool & pool, Index first, Index last, size_t grain,
+		T const & identity, Map const & map, Reduce const & reduce) {
+	if (static_cast<size_t>(last - first) <= grain) {
+		T result = identity;
+		for (; first != last; ++first)
+			result = reduce(result, map(first));
+		return result;
+	}
+	Index middle = first + (last - first) / 2;
+	T left = identity;
+	T right = identity;
+	fork_join(pool,
+		[&] { left = reduce_range(pool, first, middle, grain, identity, map, reduce); },
+		[&] { right = reduce_range(pool, middle, last, grain, identity, map, reduce); });
+	return reduce(left, right);
+}
+
+template<typename It, typename Compare>
+void sort_range(ThreadPool & pool, It first, It last, size_t grain, Compare const & comp) {
+	if (static_cast<size_t>(last - first) <= grain) {
+		std::sort(first, last, comp);
+		return;
+	}
+	It middle = first + (last - first) / 2;
+	fork_join(pool,
+		[&] { sort_range(pool, first, middle, grain, comp); },
+		[&] { sort_range(pool, middle, last, grain, comp); });
+	std::inplace_merge(first, middle, last, comp);
+}
+
+}
+
+// Вызывает fn(i) для каждого i из [first, last). Index - целое число
+// или итератор произвольного доступа. grain - наибольший кусок,
+// выполняемый одной задачей; 0 - подобрать по размеру пула.
+template<typename Index, typename Fn>
+void parallel_for(ThreadPool & pool, Index first, Index last, Fn const & fn, size_t grain = 0) {
+	if (!(first < last))
+		return;
+	size_t n = static_cast<size_t>(last - first);
+	detail::for_range(pool, first, last, grain ? grain : detail::default_grain(pool, n), fn);
+}
+
+// Сворачивает map(i) для i из [first, last) операцией reduce, которая
+// должна быть ассоциативной; identity - ее нейтральный элемент.
+template<typename Index, typename T, typename Map, typename Reduce>
+T parallel_reduce(ThreadPool & pool, Index first, Index last, T const & identity,
+		Map const & map, Reduce const & reduce, size_t grain = 0) {
+	if (!(first < last))
+		return identity;
+	size_t n = static_cast<size_t>(last - first);
+	return detail::reduce_range(pool, first, last,
+		grain ? grain : detail::default_grain(pool, n), identity, map, reduce);
+}
+
+// Сортировка слиянием: половины сортируются параллельно, затем
+// сливаются std::inplace_merge. Куски меньше grain сортируются std::sort.
+template<typename It, typename Compare>
+void parallel_sort(ThreadPool & pool, It first, It last, Compare const & comp, size_t grain = 0) {
+	size_t n = static_cast<size_t>(last - first);
+	if (n < 2)
+		return;
+	detail::sort_range(pool, first, last, grain ? grain : detail::default_grain(pool, n, 2048), comp);
+}
+
+template<typename It>
+void parallel_sort(ThreadPool & pool, It first, It last) {
+	parallel_sort(pool, first, last, std::less<typename std::iterator_traits<It>::value_type>());
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef RING_DEQUE_H
+#define RING_DEQUE_H
+
+#include <vector>
+#include <utility>
+
+// Дека на кольцевом буфере. В отличие от std::deque не освобождает и
+// не выделяет блоки по мере прохождения элементов: буфер только растет
+// (вдвое при заполнении), поэтому в установившемся режиме очередь задач
+// работает без обращений к куче.
+template<typename T>
+class RingDeque {
+public:
+	explicit RingDeque(size_t capacity = 64) : buffer(round_up(capacity)), head(0), count(0) { }
+
+	bool empty() const { return count == 0; }
+	size_t size() const { return count; }
+
+	T& front() { return buffer[head]; }
+	T& back() { return buffer[index(count - 1)]; }
+
+	void push_back(T&& value) {
+		if (count == buffer.size())
+			grow();
+		buffer[index(count)] = std::move(value);
+		++count;
+	}
+	// Элемент перемещается наружу, чтобы в буфере не оставались
+	// захваченные задачей ресурсы.
+	T pop_front() {
+		T value = std::move(buffer[head]);
+		head = index(1);
+		--count;
+		return value;
+	}
+	T pop_back() {
+		T value = std::move(buffer[index(count - 1)]);
+		--count;
+		return value;
+	}
+private:
+	static size_t round_up(size_t n) {
+		size_t capacity = 1;
+		while (capacity < n)
+			capacity <<= 1;
+		return capacity;
+	}
+	size_t index(size_t offset) const { return (head + offset) & (buffer.size() - 1); }
+	void grow() {
+		std::vector<T> bigger(buffer.size() * 2);
+		for (size_t i = 0; i < count; ++i)
+			bigger[i] = std::move(buffer[index(i)]);
+		buffer.swap(bigger);
+		head = 0;
+	}
+
+	std::vector<T> buffer;
+	size_t head;
+	size_t count;
+};
+
+#endif
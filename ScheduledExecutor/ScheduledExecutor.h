@@ -1,10 +1,14 @@
 #ifndef SCHEDULED_EXECUTOR_H
 #define SCHEDULED_EXECUTOR_H
 
-#include <list>
 #include <chrono>
 #include <algorithm>
+#include "EpollWaiter.h"
+#include "Lazy.h"
 #include "ThreadPool.h"
+#include "TimerHeap.h"
+#include "TimingWheel.h"
+#include <unordered_map>
 
 
 class ScheduledExecutor {
@@ -14,9 +18,127 @@ public:
     // например, size_t.
     typedef size_t TaskID;
 
-    
+    // Структура, в которой ждут задачи.
+    //	Heap - индексированная куча: O(log n) на постановку и отмену,
+    //	задачи запускаются точно в срок.
+    //	Wheel - иерархическое колесо: O(1) на постановку и отмену, срок
+    //	округляется вверх до тика. Подходит, когда таймеров миллионы и
+    //	большинство из них отменяют до срабатывания.
+    enum class Timers { Heap, Wheel };
+
+    // Как считается следующий запуск периодической задачи.
+    //	FixedRate - через период после предыдущего срока, независимо от
+    //	того, сколько выполнялась задача: запуски идут по сетке и ошибка
+    //	не накапливается.
+    //	FixedDelay - через период после того, как предыдущий запуск
+    //	завершился в пуле. Запуски одной задачи никогда не перекрываются.
+    enum class Repeat { FixedRate, FixedDelay };
+
+    // Что делать, если к сроку периодической задачи с фиксированным
+    // темпом предыдущий ее запуск еще не закончился или даже не начался.
+    //	Concurrent - все равно передать запуск в пул; запуски могут
+    //	выполняться одновременно и копиться в очереди пула.
+    //	Skip - пропустить запуск.
+    //	Coalesce - слить все такие запуски в один, который начнется сразу
+    //	после текущего. Если диспетчер сам опоздал на несколько периодов,
+    //	пропущенные сроки тоже сливаются в один запуск, и задача
+    //	возвращается на сетку.
+    // Пропущенные и слитые запуски считаются пропущенными.
+    enum class Overrun { Concurrent, Skip, Coalesce };
+
+    // Как диспетчер ждет ближайшего срока.
+    //	Condition - condition_variable::wait_until.
+    //	Epoll - только Linux: срок взводится в timerfd, диспетчер ждет в
+    //	epoll_wait, а будят его через eventfd. Тот же поток следит за
+    //	дескрипторами, зарегистрированными через WatchFd.
+    enum class Wait { Condition, Epoll };
+
+    // Когда начинать вычисление ленивой задачи.
+    //	OnDemand - при первом get(), в потоке, который его вызвал.
+    //	WhenIdle - сразу в свободном потоке пула с приоритетом Low, если
+    //	такой поток есть. Если get() успеет раньше, задача выполнится в
+    //	его потоке, как при OnDemand, а запуск из пула ничего не сделает.
+    enum class Prefetch { OnDemand, WhenIdle };
+
+    // Параметры executor-а. tick, wheel_bits и wheel_levels задают колесо:
+    // длительность тика и 2^wheel_bits слотов на каждом из wheel_levels
+    // уровней. По умолчанию 4 уровня по 256 слотов с тиком 1 мс покрывают
+    // около 50 дней; более далекие задачи ждут в отдельном списке.
+    // shards - число шардов таймеров. У каждого шарда свои мьютекс,
+    // очередь таймеров и поток диспетчера, а пул общий. Задача попадает в
+    // шард потока, который ее поставил, а номер шарда закодирован в
+    // TaskID, так что отмена сразу идет в нужный шард. Несколько шардов
+    // нужны, когда задачи ставят и отменяют из многих потоков сразу.
+    struct Options {
+        ThreadPool::Options pool;
+        Timers timers = Timers::Heap;
+        std::chrono::microseconds tick {1000};
+        unsigned wheel_bits = 8;
+        unsigned wheel_levels = 4;
+        size_t shards = 1;
+        Wait wait = Wait::Condition;
+    };
+
+    // Дескриптор поставленной задачи. Cancel помечает задачу мертвой
+    // атомарным флагом, общим с задачей в executor-е, и не берет ни
+    // одного мьютекса, так что стоит O(1) и не мешает диспетчеру.
+    // Через дескриптор видны и счетчики запусков задачи: пропущенных по
+    // политике Overrun и опоздавших, то есть начавшихся в пуле позже
+    // срока следующего запуска. Если опоздавших много, задача не
+    // успевает за своим периодом.
+    // Мертвую задачу диспетчер пропускает и удаляет, когда доходит до
+    // нее, а те, до чьего срока далеко, вычищаются проходом по очереди,
+    // когда она разрастается вдвое. Дескриптор можно копировать и
+    // пользоваться им после остановки executor-а. Неявно приводится к
+    // TaskID, который принимает CancelPeriodicTask. Пустой дескриптор,
+    // созданный по умолчанию, не относится ни к одной задаче: его TaskID
+    // равен TaskID(-1), и отмена через него ничего не делает.
+    class TaskHandle {
+    public:
+        TaskHandle() : taskId(TaskID(-1)) { }
+        TaskID Id() const { return taskId; }
+        operator TaskID() const { return taskId; }
+        // Возвращает false, если задача уже была отменена этим или
+        // другим дескриптором. Выполняющийся запуск не прерывается, а
+        // запуск, уже переданный в пул, но еще не начавшийся, пропускается.
+        bool Cancel() {
+            return control && !control->cancelled.exchange(true, std::memory_order_relaxed);
+        }
+        bool IsCancelled() const {
+            return control && control->cancelled.load(std::memory_order_relaxed);
+        }
+        uint64_t SkippedRuns() const { return control ? control->skipped.load() : 0; }
+        uint64_t LateRuns() const { return control ? control->late.load() : 0; }
+    private:
+        friend class ScheduledExecutor;
+        // Общее состояние задачи в executor-е и ее дескрипторов. state -
+        // запуски задачи в пуле для политик Skip и Coalesce: 0 - нет,
+        // 1 - один запуск, 2 - запуск и слитый с ним следующий.
+        struct Control {
+            Control() : cancelled(false), state(0), skipped(0), late(0) { }
+            std::atomic<bool> cancelled;
+            std::atomic<unsigned> state;
+            std::atomic<uint64_t> skipped;
+            std::atomic<uint64_t> late;
+        };
+        TaskHandle(TaskID taskId, std::shared_ptr<Control> control) :
+        taskId(taskId), control(std::move(control)) { }
+        TaskID taskId;
+        std::shared_ptr<Control> control;
+    };
+
 public:
     explicit ScheduledExecutor(size_t);
+    // Позволяет, например, ограничить очередь пула. Диспетчер никогда не
+    // ждет места в очереди. Запуск периодической задачи, для которого
+    // нет места, пропускается и считается в DroppedRuns: задача все равно
+    // придет через период. Однократная задача остается в очереди
+    // таймеров, и диспетчер снова пробует передать ее в пул через
+    // retryDelay миллисекунд; только с политикой Overflow::Discard она
+    // отбрасывается и тоже считается пропущенной. Продолжения сопрограмм
+    // после sleep_for идут в обход ограничения очереди.
+    explicit ScheduledExecutor(ThreadPool::Options const &);
+    explicit ScheduledExecutor(Options const &);
     ~ScheduledExecutor();
     ScheduledExecutor(ScheduledExecutor const &) = delete;
     ScheduledExecutor(ScheduledExecutor &&) = delete;
@@ -30,10 +152,14 @@ public:
     // 	fn - функция, которую следует запустить.
     //	delay - время в миллисекундах, через которое нужно
     //	запустить задачу.
+    //	priority - полоса пула, в которую задача попадет при запуске.
+    //	slack - на сколько миллисекунд задаче допустимо опоздать.
     template<typename Fn>
-    TaskID ScheduleDelayedTask(Fn && fn, long delay = 0) {
+    TaskHandle ScheduleDelayedTask(Fn && fn, long delay = 0,
+                                   ThreadPool::Priority priority = ThreadPool::Priority::Normal,
+                                   long slack = 0) {
         
-        return SchedulePeriodicTask(std::forward<Fn>(fn), delay, 0);
+        return SchedulePeriodicTask(std::forward<Fn>(fn), delay, 0, priority, Repeat::FixedRate, slack);
     }
     
     // Запускает отложенную задачу, которая будет выполнена 1 раз с
@@ -45,40 +171,202 @@ public:
     //	миллисекундах.
     //	period - время в миллисекундах, через которое задача будет
     //	повторяться.
+    //	priority - полоса пула, в которую задача попадает при каждом
+    //	запуске. Например, High для сердцебиений, которые не должны ждать
+    //	за пакетной работой.
+    //	repeat - как отсчитывается период, см. Repeat.
+    //	slack - на сколько миллисекунд каждому запуску допустимо
+    //	опоздать. Диспетчер просыпается не позже срока плюс slack и
+    //	заодно запускает все задачи, чей срок к этому моменту наступил,
+    //	так что задачи с пересекающимися окнами обходятся одним
+    //	пробуждением. Период отсчитывается от срока, а не от
+    //	фактического запуска.
+    //	overrun - что делать, если предыдущий запуск еще не закончился,
+    //	см. Overrun. Для FixedDelay не нужен: там запуски не
+    //	перекрываются.
     template<typename Fn>
-    TaskID SchedulePeriodicTask(Fn && fn, long delay = 0, long period = 0) {
+    TaskHandle SchedulePeriodicTask(Fn && fn, long delay = 0, long period = 0,
+                                    ThreadPool::Priority priority = ThreadPool::Priority::Normal,
+                                    Repeat repeat = Repeat::FixedRate, long slack = 0,
+                                    Overrun overrun = Overrun::Concurrent) {
         
-        if (stop)
-            throw std::runtime_error("ScheduledExecutor was stopped.");
-        std::unique_lock<std::mutex> lock(mutex);
-        tasks.emplace_back(std::forward<Fn>(fn), id, delay, period);
-        lock.unlock();
-        condition.notify_one();
-        return id++;
+        return schedule(Task(std::forward<Fn>(fn), period, priority, repeat, slack, overrun), delay);
     }
     
     // Запускает задачу, которая будет посчитана только в тот
-    // момент, когда на объекте std::future, возвращаемом этой
-    // функцией, будет вызван метод get().
+    // момент, когда на объекте Lazy, возвращаемом этой функцией,
+    // впервые будет вызван метод get(). Результат считается один раз и
+    // достается всем копиям Lazy; см. Lazy.
     // Параметры:
+    //	prefetch - начинать ли вычисление заранее, см. Prefetch.
     //	fn - задача, которая будет запущена.
+    //	args - аргументы fn. Они перемещаются в задачу один раз и
+    //	передаются в fn по ссылке.
     template<typename Fn, typename... Args>
-    auto ScheduleLazyTask(Fn&& fn, Args&&... args) ->
-    std::future < typename std::result_of<Fn(Args...)>::type > {
+    auto ScheduleLazyTask(Prefetch prefetch, Fn&& fn, Args&&... args) ->
+    Lazy < typename std::result_of<Fn(Args...)>::type > {
         if (stop)
             throw std::runtime_error("ScheduledExecutor was stopped.");
-        return std::async(std::launch::deferred, fn, args...);
+        auto lazy = make_lazy(std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...));
+        // Свободный поток проверяется без блокировки, поэтому задача
+        // может и подождать в очереди; тогда ее, скорее всего, посчитает
+        // первый get(). Предвыборка идет в обход ограничения очереди: ее
+        // не должна отбросить политика переполнения и она не должна
+        // считаться отклоненной задачей пользователя.
+        if (prefetch == Prefetch::WhenIdle && threadPool.idle_threads() > 0)
+            threadPool.post_unbounded(ThreadPool::Priority::Low, lazy.runner());
+        return lazy;
+    }
+    template<typename Fn, typename... Args>
+    auto ScheduleLazyTask(Fn&& fn, Args&&... args) ->
+    Lazy < typename std::result_of<Fn(Args...)>::type > {
+        return ScheduleLazyTask(Prefetch::OnDemand, std::forward<Fn>(fn), std::forward<Args>(args)...);
+    }
+    
+    // Ожидаемый объект для сопрограмм C++20: co_await
+    // executor.sleep_for(delay) ставит отложенную задачу, которая через
+    // delay миллисекунд продолжит сопрограмму в потоке пула. Пока
+    // сопрограмма спит, она не занимает ни одного потока. Если executor
+    // остановят раньше, сопрограмма так и не будет продолжена.
+    class SleepAwaiter {
+    public:
+        SleepAwaiter(ScheduledExecutor* executor, long delay, ThreadPool::Priority priority) :
+        executor(executor), delay(delay), priority(priority) { }
+        bool await_ready() const { return delay <= 0; }
+        template<typename Handle>
+        void await_suspend(Handle handle) {
+            Task task([handle]() mutable { handle.resume(); }, 0, priority, Repeat::FixedRate, 0,
+                      Overrun::Concurrent);
+            task._unbounded = true;
+            executor->schedule(std::move(task), delay);
+        }
+        void await_resume() const { }
+    private:
+        ScheduledExecutor* executor;
+        long delay;
+        ThreadPool::Priority priority;
+    };
+    SleepAwaiter sleep_for(long delay,
+                           ThreadPool::Priority priority = ThreadPool::Priority::Normal) {
+        return SleepAwaiter(this, delay, priority);
     }
     
     // Прекращает запуски задания с заданным id. Если в данный
     // момент это задание выполняется, то прерывать выполнение не
-    // требуется.
+    // требуется. Задача помечается отмененной так же, как через
+    // TaskHandle::Cancel, поэтому запуски, уже переданные в пул, но
+    // еще не начавшиеся, пропускаются, а дескрипторы задачи видят
+    // отмену. Диспетчер не будится: проснувшись к сроку отмененной
+    // задачи, он просто не найдет ее в очереди.
     void CancelPeriodicTask(TaskID const & id) {
-        {
-            std::unique_lock<std::mutex> lock(mutex);
-            tasks.remove_if([id](const Task& t) { return t._id == id; });
+        if (id == TaskID(-1))
+            return;
+        Shard & shard = *shards[id % shards.size()];
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        if (Task * task = shard.tasks->find(id)) {
+            task->_control->cancelled = true;
+            shard.tasks->erase(id);
+            return;
         }
-        condition.notify_one();
+        auto it = shard.running.find(id);
+        if (it != shard.running.end()) {
+            it->second->cancelled = true;
+            shard.running.erase(it);
+        }
+    }
+    // Отменяет задачи по дескрипторам из диапазона [first, last).
+    // Возвращает, сколько из них не было отменено раньше.
+    template<typename It>
+    static size_t CancelTasks(It first, It last) {
+        size_t res = 0;
+        for (; first != last; ++first)
+            res += first->Cancel();
+        return res;
+    }
+    
+    // Передает в пул callback(events), когда дескриптор fd готов к
+    // событиям events (EPOLLIN, EPOLLOUT и т.д.). Пока обработчик не
+    // завершился, дескриптор не проверяется, так что обработчики одного
+    // дескриптора не перекрываются. Работает только с Wait::Epoll.
+    // Дескриптор должен оставаться открытым, пока его не снимут через
+    // UnwatchFd.
+    void WatchFd(int fd, uint32_t events, std::function<void(uint32_t)> callback,
+                 ThreadPool::Priority priority = ThreadPool::Priority::Normal) {
+        Shard & shard = *shards[static_cast<size_t>(fd) % shards.size()];
+        if (!shard.epoll)
+            throw std::logic_error("ScheduledExecutor::WatchFd requires Wait::Epoll.");
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        if (shard.watches.count(fd))
+            throw std::invalid_argument("File descriptor is already watched.");
+        shard.epoll->add(fd, events);
+        Watch & watch = shard.watches[fd];
+        watch.callback = std::move(callback);
+        watch.events = events;
+        watch.priority = priority;
+        watch.generation = ++shard.watchGeneration;
+    }
+    // Снимает дескриптор с наблюдения. Обработчик, уже переданный в пул,
+    // доработает, но дескриптор больше не взведет.
+    void UnwatchFd(int fd) {
+        Shard & shard = *shards[static_cast<size_t>(fd) % shards.size()];
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        if (shard.watches.erase(fd))
+            shard.epoll->remove(fd);
+    }
+    
+    // Число запусков, пропущенных из-за переполнения очереди пула.
+    size_t DroppedRuns() const { return droppedRuns; }
+    // Число запусков задач и обработчиков дескрипторов, завершившихся
+    // исключением. Исключение не выходит за пределы запуска: следующие
+    // запуски той же задачи идут по расписанию.
+    size_t FailedRuns() const { return failedRuns; }
+    
+    // Снимок метрик: метрики пула, число ожидающих задач (в том числе
+    // отмененных через TaskHandle, но еще не вычищенных), число
+    // запусков, переданных в пул, число пробуждений диспетчера, число
+    // запусков, которые пришлись на пробуждение ради другой задачи
+    // раньше крайнего срока (сэкономленные пробуждения), число
+    // запусков, пропущенных по политике Overrun, число запусков,
+    // начавшихся в пуле позже срока следующего, и запаздывание запуска
+    // относительно назначенного времени в наносекундах.
+    // Запуск передается в пул с назначенным временем в качестве срока,
+    // так что pool.lateness - опоздание начала запуска в пуле, а
+    // pool.slo_violations - запуски, опоздавшие больше
+    // ThreadPool::Options::slo. С ThreadPool::Order::Deadline опоздавший
+    // запуск обгоняет в своей полосе задачи с более поздним сроком.
+    struct Metrics {
+        ThreadPool::Metrics pool;
+        size_t timers;
+        uint64_t dispatched;
+        uint64_t dropped;
+        uint64_t wakeups;
+        uint64_t coalesced;
+        uint64_t skipped;
+        uint64_t late;
+        Histogram::Snapshot lateness;
+    };
+    Metrics GetMetrics() const {
+        Metrics res;
+        res.pool = threadPool.metrics();
+        res.timers = 0;
+        res.dispatched = 0;
+        res.dropped = droppedRuns;
+        res.wakeups = 0;
+        res.coalesced = 0;
+        res.skipped = 0;
+        res.late = lateRuns;
+        for (auto const & shard : shards) {
+            {
+                std::unique_lock<std::mutex> lock(shard->mutex);
+                res.timers += shard->tasks->size();
+            }
+            res.dispatched += shard->dispatchedRuns.get();
+            res.wakeups += shard->wakeups.get();
+            res.coalesced += shard->coalescedRuns.get();
+            res.skipped += shard->skippedRuns.get();
+            shard->lateness.collect(res.lateness);
+        }
+        return res;
     }
     
     // Прекращает запуски всех заданий. Если какие-то из них
@@ -87,63 +375,467 @@ public:
     void Shutdown();
     
 private:
-    void run() {
+    // Сроки отсчитываются по монотонным часам: перевод системного
+    // времени не сдвигает запуски.
+    typedef std::chrono::steady_clock Clock;
+
+    struct Shard;
+    struct Task;
+    // Ставит задачу в шард потока, который ее ставит, и будит диспетчер
+    // шарда, если срок задачи раньше того, до которого он спит.
+    TaskHandle schedule(Task task, long delay) {
+        if (stop)
+            throw std::runtime_error("ScheduledExecutor was stopped.");
+        std::shared_ptr<Control> control = task._control;
+        auto execTime = Clock::now() + std::chrono::milliseconds(delay + task._slack);
+        Shard & shard = *shards[threadIndex() % shards.size()];
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        TaskID taskId = shard.id++ * shards.size() + shard.index;
+        shard.tasks->push(taskId, execTime, std::move(task));
+        if (shard.tasks->size() >= shard.purgeAt) {
+            shard.tasks->purge(&Task::dead);
+            shard.purgeAt = std::max(size_t(minPurge), 2 * shard.tasks->size());
+        }
+        bool wake = execTime < shard.wakeTime;
+        lock.unlock();
+        if (wake)
+            wakeUp(shard);
+        return TaskHandle(taskId, std::move(control));
+    }
+    // Диспетчер шарда спит до ближайшего срока, а проснувшись, забирает
+    // из очереди все задачи, срок которых наступил, и отдает их пулу
+    // пачками по полосам уже без блокировки: пока пул принимает задачи,
+    // в шард можно ставить и отменять новые. Будят диспетчер, только
+    // если новый срок раньше того, до которого он спит.
+    void run(Shard & shard) {
+        std::unique_lock<std::mutex> lock(shard.mutex);
         while (!stop) {
-            std::unique_lock<std::mutex> lock(mutex);
-            if (tasks.empty())
-                condition.wait(lock);
-            if (stop)
-                return;
-            auto priorityTask = std::min_element(tasks.begin(), tasks.end(), [](const Task& t, const Task& p)
-            {
-                return t._execTime < p._execTime;
-            });
-            auto condition_status = condition.wait_until(lock, priorityTask->_execTime);
-            if (stop)
-                return;
-            if (std::cv_status::timeout == condition_status)
-                threadPool.enqueue(priorityTask->_fn);
-            if (std::cv_status::no_timeout == condition_status)
+            auto now = Clock::now();
+            shard.tasks->advance(now);
+            if (shard.tasks->empty()) {
+                shard.wakeTime = Clock::time_point::max();
+                sleep(shard, lock);
+            } else if (now < shard.tasks->next_deadline()) {
+                shard.wakeTime = shard.tasks->next_deadline();
+                sleep(shard, lock);
+            } else {
+                shard.wakeTime = Clock::time_point::min();
+                shard.wakeups.add(1);
+                collect(shard, now);
+                lock.unlock();
+                dispatch(shard, now);
+                lock.lock();
                 continue;
-            if (!priorityTask->_period)
-                tasks.erase(priorityTask);
+            }
+            shard.wakeTime = Clock::time_point::min();
+        }
+    }
+
+    // Ждет до wakeTime или пробуждения. Диспетчер на epoll ждет без
+    // мьютекса, а проснувшись, передает в пул обработчики готовых
+    // дескрипторов.
+    void sleep(Shard & shard, std::unique_lock<std::mutex> & lock) {
+        if (!shard.epoll) {
+            if (shard.wakeTime == Clock::time_point::max())
+                shard.condition.wait(lock);
             else
-                priorityTask->_execTime += std::chrono::milliseconds(priorityTask -> _period + priorityTask -> _delay);
+                shard.condition.wait_until(lock, shard.wakeTime);
+            return;
+        }
+        shard.epoll->arm(shard.wakeTime);
+        lock.unlock();
+        shard.epoll->wait(shard.ready);
+        lock.lock();
+        if (shard.ready.empty())
+            return;
+        for (auto const & fd : shard.ready) {
+            auto it = shard.watches.find(fd.first);
+            if (it != shard.watches.end())
+                shard.watchRuns.emplace_back(&shard, fd.first, fd.second, it->second);
         }
+        shard.ready.clear();
+        lock.unlock();
+        // Обработчик, которому не хватило места в пуле, пропускается, а
+        // дескриптор взводится снова, и событие придет еще раз. Диспетчер
+        // не ждет места, чтобы не задерживать таймеры шарда.
+        for (WatchRun & run : shard.watchRuns) {
+            int fd = run.fd;
+            uint64_t generation = run.generation;
+            if (!threadPool.try_post(run.priority, std::move(run))) {
+                ++droppedRuns;
+                rewatch(shard, fd, generation);
+            }
+        }
+        shard.watchRuns.clear();
+        lock.lock();
+    }
+    void wakeUp(Shard & shard) {
+        if (shard.epoll)
+            shard.epoll->wake();
+        else
+            shard.condition.notify_one();
+    }
+    // Снова взводит дескриптор, если его не сняли и не зарегистрировали
+    // заново, пока работал обработчик. Если дескриптор уже закрыт,
+    // наблюдение за ним снимается.
+    void rewatch(Shard & shard, int fd, uint64_t generation) {
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        auto it = shard.watches.find(fd);
+        if (stop || it == shard.watches.end() || it->second.generation != generation)
+            return;
+        try {
+            shard.epoll->rearm(fd, it->second.events);
+        } catch (std::exception const &) {
+            shard.watches.erase(it);
+        }
+    }
 
+    struct Run;
+    // Снимает с очереди задачи, срок которых наступил к now. Очередь
+    // упорядочена по крайнему сроку, то есть сроку плюс slack, и обход,
+    // как в hrtimer Linux, останавливается на первой задаче, срок которой
+    // еще не наступил. Периодическая задача с фиксированным темпом сразу
+    // получает следующий срок, а с фиксированной задержкой уходит из
+    // очереди до конца запуска: ее номер лежит в running, а саму задачу
+    // держит запуск в пуле.
+    void collect(Shard & shard, Clock::time_point now) {
+        Queue & tasks = *shard.tasks;
+        while (tasks.has_top()) {
+            TaskID taskId = tasks.top_id();
+            auto latest = tasks.top_deadline();
+            Task & task = tasks.top();
+            if (Task::dead(task)) {
+                tasks.pop();
+                continue;
+            }
+            auto execTime = latest - std::chrono::milliseconds(task._slack);
+            if (now < execTime)
+                break;
+            if (now < latest)
+                shard.coalescedRuns.add(1);
+            shard.lateness.record(now - execTime);
+            std::vector<Run> & batch = shard.due[static_cast<size_t>(task._priority)];
+            if (task._period && task._repeat == Repeat::FixedRate) {
+                std::chrono::milliseconds period(task._period);
+                auto next = latest + period;
+                if (task._overrun == Overrun::Coalesce && !(now < execTime + period)) {
+                    auto missed = (now - execTime) / period;
+                    next += period * missed;
+                    skip(shard, task, static_cast<uint64_t>(missed));
+                }
+                if (admit(shard, task)) {
+                    shard.dispatchedRuns.add(1);
+                    batch.emplace_back(&shard, taskId, task, execTime);
+                }
+                tasks.reschedule_top(next);
+                continue;
+            }
+            shard.dispatchedRuns.add(1);
+            if (task._period)
+                shard.running.emplace(taskId, task._control);
+            batch.emplace_back(&shard, taskId, std::move(task), execTime);
+            tasks.pop();
+        }
+    }
+    // Решает по политике Overrun, передавать ли в пул очередной запуск
+    // задачи с фиксированным темпом. Запуск, пришедший, пока предыдущий
+    // еще в пуле, при Coalesce откладывается до его конца, а все
+    // следующие сливаются с отложенным.
+    bool admit(Shard & shard, Task const & task) {
+        if (task._overrun == Overrun::Concurrent)
+            return true;
+        std::atomic<unsigned> & state = task._control->state;
+        unsigned current = state.load();
+        for (;;) {
+            if (current == 0) {
+                if (state.compare_exchange_weak(current, 1))
+                    return true;
+                continue;
+            }
+            if (task._overrun == Overrun::Skip || current == 2) {
+                skip(shard, task, 1);
+                return false;
+            }
+            if (state.compare_exchange_weak(current, 2))
+                return false;
+        }
+    }
+    void skip(Shard & shard, Task const & task, uint64_t runs) {
+        task._control->skipped += runs;
+        shard.skippedRuns.add(runs);
+    }
+    // Запуски периодических задач, которым не хватило места в пуле,
+    // пропускаются, а однократные откладываются на retryDelay: ожидание
+    // места или запуск в потоке диспетчера задержали бы все остальные
+    // таймеры и дескрипторы шарда.
+    void dispatch(Shard & shard, Clock::time_point now) {
+        for (size_t lane = 0; lane < ThreadPool::lane_count; ++lane) {
+            std::vector<Run> & batch = shard.due[lane];
+            if (batch.empty())
+                continue;
+            size_t posted = threadPool.try_post_bulk(static_cast<ThreadPool::Priority>(lane),
+                std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()),
+                [](Run const & run) { return run.deadline; });
+            for (size_t i = posted; i < batch.size(); ++i)
+                overflow(batch[i], now);
+            batch.clear();
+        }
+    }
+    void overflow(Run & run, Clock::time_point now) {
+        Task & task = run.task;
+        if (task._unbounded) {
+            threadPool.post_unbounded(task._priority, std::move(run));
+            return;
+        }
+        if (!task._period && overflowPolicy != ThreadPool::Overflow::Discard) {
+            retry(*run.shard, run.taskId, std::move(task), now + std::chrono::milliseconds(long(retryDelay)));
+            return;
+        }
+        ++droppedRuns;
+        if (!task._period)
+            return;
+        if (task._repeat == Repeat::FixedRate)
+            task._control->state = 0;
+        else
+            rearm(*run.shard, run.taskId, std::move(task), now + std::chrono::milliseconds(task._period));
+    }
+    // Возвращает в очередь задачу с фиксированной задержкой, если ее не
+    // отменили, пока она выполнялась.
+    void rearm(Shard & shard, TaskID taskId, Task task, Clock::time_point execTime) {
+        execTime += std::chrono::milliseconds(task._slack);
+        bool wake;
+        {
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            if (!shard.running.erase(taskId) || stop || Task::dead(task))
+                return;
+            shard.tasks->push(taskId, execTime, std::move(task));
+            wake = execTime < shard.wakeTime;
+        }
+        if (wake)
+            wakeUp(shard);
+    }
+    // Возвращает в очередь однократную задачу, которой не хватило места
+    // в пуле. Вызывается из потока диспетчера между проходами, поэтому
+    // будить его не нужно.
+    void retry(Shard & shard, TaskID taskId, Task task, Clock::time_point execTime) {
+        execTime += std::chrono::milliseconds(task._slack);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        if (stop || Task::dead(task))
+            return;
+        shard.tasks->push(taskId, execTime, std::move(task));
+    }
+    // Номер, который поток получает при первой постановке задачи в любой
+    // executor. Потоки раскладываются по шардам по кругу.
+    static size_t threadIndex() {
+        static std::atomic<size_t> next {0};
+        static thread_local size_t index = next++;
+        return index;
     }
 
+    typedef TaskHandle::Control Control;
+    // В очереди таймеров рядом с задачей хранится крайний срок ее
+    // запуска: срок плюс _slack. Состояние _control общее с TaskHandle.
+    // _unbounded - продолжение сопрограммы: если в пуле нет места, оно
+    // ставится в обход ограничения очереди, иначе сопрограмма так и не
+    // продолжится.
     struct Task {
-        Task(std::function<void()> fn, ScheduledExecutor::TaskID id, long delay, long period) :
-        _fn(fn), _id(id), _delay(delay), _period(period), _execTime(std::chrono::milliseconds(delay) + std::chrono::system_clock::now()) { }
+        Task() = default;
+        Task(std::function<void()> fn, long period, ThreadPool::Priority priority, Repeat repeat,
+             long slack, Overrun overrun) :
+        _fn(std::move(fn)), _period(period), _priority(priority), _repeat(repeat), _slack(slack),
+        _overrun(overrun), _control(std::make_shared<Control>()) { }
+        static bool dead(Task const & task) {
+            return task._control->cancelled.load(std::memory_order_relaxed);
+        }
         std::function<void()> _fn = nullptr;
-        ScheduledExecutor::TaskID _id = 0;
-        long _delay = 0;
         long _period = 0;
-        std::chrono::system_clock::time_point _execTime = std::chrono::system_clock::time_point();
+        ThreadPool::Priority _priority = ThreadPool::Priority::Normal;
+        Repeat _repeat = Repeat::FixedRate;
+        long _slack = 0;
+        Overrun _overrun = Overrun::Concurrent;
+        bool _unbounded = false;
+        std::shared_ptr<Control> _control;
     };
-    TaskID id = 0;
-    std::list<Task> tasks;
-    std::thread thread;
-    ThreadPool threadPool;
+    // Один запуск задачи в пуле. Запуск с фиксированной задержкой по
+    // завершении отсчитывает от текущего времени следующий срок, а
+    // запуск с политикой Skip или Coalesce сразу выполняет отложенный,
+    // если такой появился.
+    struct Run {
+        Run(Shard* shard, TaskID taskId, Task task, Clock::time_point deadline) :
+        shard(shard), taskId(taskId), task(std::move(task)), deadline(deadline) { }
+        void operator()() {
+            if (task._repeat == Repeat::FixedDelay) {
+                invoke(true);
+                if (task._period)
+                    shard->executor->rearm(*shard, taskId, std::move(task),
+                                           Clock::now() + std::chrono::milliseconds(task._period));
+                return;
+            }
+            if (!task._period || task._overrun == Overrun::Concurrent) {
+                invoke(true);
+                return;
+            }
+            bool first = true;
+            do {
+                invoke(first);
+                first = false;
+            } while (task._control->state.fetch_sub(1) == 2);
+        }
+        // Отложенный запуск Coalesce опаздывает по определению, поэтому
+        // его опоздание не проверяется.
+        void invoke(bool checkLate) {
+            if (Task::dead(task))
+                return;
+            if (checkLate && task._period
+                && Clock::now() - deadline > std::chrono::milliseconds(task._period)) {
+                ++task._control->late;
+                ++shard->executor->lateRuns;
+            }
+            try {
+                task._fn();
+            } catch (...) {
+                ++shard->executor->failedRuns;
+            }
+        }
+        Shard* shard;
+        TaskID taskId;
+        Task task;
+        Clock::time_point deadline;
+    };
+    struct Watch {
+        std::function<void(uint32_t)> callback;
+        uint32_t events;
+        ThreadPool::Priority priority;
+        uint64_t generation;
+    };
+    // Вызов обработчика дескриптора в пуле.
+    struct WatchRun {
+        WatchRun(Shard* shard, int fd, uint32_t events, Watch const & watch) :
+        shard(shard), fd(fd), events(events), priority(watch.priority),
+        generation(watch.generation), callback(watch.callback) { }
+        void operator()() {
+            try {
+                callback(events);
+            } catch (...) {
+                ++shard->executor->failedRuns;
+            }
+            shard->executor->rewatch(*shard, fd, generation);
+        }
+        Shard* shard;
+        int fd;
+        uint32_t events;
+        ThreadPool::Priority priority;
+        uint64_t generation;
+        std::function<void(uint32_t)> callback;
+    };
+    typedef TimerQueue<Task, Clock::time_point> Queue;
+    static const size_t minPurge = 1024;
+    // Через сколько миллисекунд диспетчер снова пробует передать в пул
+    // однократную задачу, которой не хватило места.
+    static const long retryDelay = 1;
+    // Шард таймеров. Задачи с номерами index, index + n, index + 2n, ...
+    // при n шардах живут в нем.
+    struct Shard {
+        Shard(ScheduledExecutor* executor, size_t index, Queue* tasks) :
+        executor(executor), index(index), tasks(tasks) { }
+        ScheduledExecutor* executor;
+        size_t index;
+        TaskID id = 0;
+        std::unique_ptr<Queue> tasks;
+        // Размер очереди, при котором из нее вычищаются отмененные задачи.
+        size_t purgeAt = minPurge;
+        // Задачи с фиксированной задержкой, которые сейчас выполняются.
+        std::unordered_map<TaskID, std::shared_ptr<Control>> running;
+        // Срок, до которого спит диспетчер; min, пока он не спит.
+        Clock::time_point wakeTime = Clock::time_point::min();
+        // Пишутся только потоком диспетчера.
+        Counter dispatchedRuns;
+        Counter wakeups;
+        Counter coalescedRuns;
+        Counter skippedRuns;
+        Histogram lateness;
+        std::vector<Run> due[ThreadPool::lane_count];
+        mutable std::mutex mutex;
+        std::condition_variable condition;
+        // Только для Wait::Epoll.
+        std::unique_ptr<EpollWaiter> epoll;
+        std::unordered_map<int, Watch> watches;
+        uint64_t watchGeneration = 0;
+        std::vector<std::pair<int, uint32_t>> ready;
+        std::vector<WatchRun> watchRuns;
+        std::thread thread;
+    };
+    static ThreadPool::Options poolOptions(size_t threads) {
+        ThreadPool::Options options;
+        options.threads = threads;
+        return options;
+    }
+    static Options executorOptions(ThreadPool::Options const & pool) {
+        Options options;
+        options.pool = pool;
+        return options;
+    }
+    static Queue * makeQueue(Options const & options) {
+        if (options.timers == Timers::Wheel)
+            return new TimingWheel<Task, Clock::time_point>(Clock::now(),
+                std::chrono::duration_cast<Clock::duration>(options.tick),
+                options.wheel_bits, options.wheel_levels);
+        return new TimerHeap<Task, Clock::time_point>;
+    }
+    std::vector<std::unique_ptr<Shard>> shards;
     std::atomic<bool> stop {false};
-    std::mutex mutex;
-    std::condition_variable condition;
+    std::atomic<size_t> droppedRuns {0};
+    std::atomic<size_t> failedRuns {0};
+    std::atomic<uint64_t> lateRuns {0};
+    ThreadPool::Overflow overflowPolicy;
+    // Пул разрушается раньше шардов: запуски с фиксированной задержкой,
+    // которые он дорабатывает, обращаются к ним.
+    ThreadPool threadPool;
 };
 
 
-inline ScheduledExecutor::ScheduledExecutor(size_t threadPoolSize) : threadPool(threadPoolSize),
-                                thread(&ScheduledExecutor::run, this) { }
+inline ScheduledExecutor::ScheduledExecutor(size_t threadPoolSize) :
+                                ScheduledExecutor(poolOptions(threadPoolSize)) { }
+
+inline ScheduledExecutor::ScheduledExecutor(ThreadPool::Options const & options) :
+                                ScheduledExecutor(executorOptions(options)) { }
+
+// Потоки диспетчеров запускаются, когда все шарды уже созданы.
+inline ScheduledExecutor::ScheduledExecutor(Options const & options) :
+                                overflowPolicy(options.pool.overflow), threadPool(options.pool) {
+    size_t count = std::max<size_t>(options.shards, 1);
+    for (size_t i = 0; i < count; ++i) {
+        shards.emplace_back(new Shard(this, i, makeQueue(options)));
+        if (options.wait == Wait::Epoll)
+            shards.back()->epoll.reset(new EpollWaiter);
+    }
+    try {
+        for (auto & shard : shards)
+            shard->thread = std::thread(&ScheduledExecutor::run, this, std::ref(*shard));
+    } catch (...) {
+        Shutdown();
+        throw;
+    }
+}
 
+// Диспетчер проверяет stop под мьютексом своего шарда, поэтому после
+// того, как Shutdown взял и отпустил этот мьютекс, диспетчер либо уже
+// видит stop, либо ждет и получит notify. Повторный вызов, в том числе
+// из деструктора после явного Shutdown, ничего не делает.
 inline void ScheduledExecutor::Shutdown() {
     stop = true;
-    
-    {
-        std::unique_lock<std::mutex> lock(mutex);
-        tasks.clear();
+    for (auto & shard : shards) {
+        {
+            std::unique_lock<std::mutex> lock(shard->mutex);
+            shard->tasks->clear();
+            shard->running.clear();
+            shard->watches.clear();
+        }
+        wakeUp(*shard);
     }
-    condition.notify_one();
-    thread.join();
+    for (auto & shard : shards)
+        if (shard->thread.joinable())
+            shard->thread.join();
 }
 
 inline ScheduledExecutor::~ScheduledExecutor() {
@@ -0,0 +1,100 @@
+#ifndef TASK_FUNCTION_H
+#define TASK_FUNCTION_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+// Перемещаемая (но не копируемая) обертка над void(), заменяющая
+// std::function в очередях пула. Функторы размером до inline_size байт
+// хранятся прямо в объекте, так что постановка маленькой задачи не
+// выделяет память в куче. Большие функторы хранятся в куче, как и
+// в std::function.
+class TaskFunction {
+public:
+	static const size_t inline_size = 96;
+
+	TaskFunction() noexcept : invoke(nullptr), manage(nullptr) { }
+
+	template<typename Fn, typename = typename std::enable_if<
+		!std::is_same<typename std::decay<Fn>::type, TaskFunction>::value>::type>
+	TaskFunction(Fn&& fn) : invoke(nullptr), manage(nullptr) {
+		typedef typename std::decay<Fn>::type Functor;
+		init<Functor>(std::forward<Fn>(fn), std::integral_constant<bool, fits_inline<Functor>()>());
+	}
+
+	TaskFunction(TaskFunction&& other) noexcept : invoke(nullptr), manage(nullptr) {
+		move_from(other);
+	}
+	TaskFunction& operator = (TaskFunction&& other) noexcept {
+		if (this != &other) {
+			reset();
+			move_from(other);
+		}
+		return *this;
+	}
+	TaskFunction(TaskFunction const &) = delete;
+	TaskFunction& operator = (TaskFunction const &) = delete;
+	~TaskFunction() { reset(); }
+
+	void operator()() { invoke(&storage); }
+	explicit operator bool() const noexcept { return invoke != nullptr; }
+
+	template<typename Functor>
+	static constexpr bool fits_inline() {
+		return sizeof(Functor) <= inline_size
+			&& alignof(Functor) <= alignof(std::max_align_t)
+			&& std::is_nothrow_move_constructible<Functor>::value;
+	}
+private:
+	enum class Op { Move, Destroy };
+	typedef void (*Invoke)(void*);
+	typedef void (*Manage)(Op, void*, void*);
+
+	template<typename Functor, typename Fn>
+	void init(Fn&& fn, std::true_type) {
+		::new (static_cast<void*>(&storage)) Functor(std::forward<Fn>(fn));
+		invoke = [](void* self) { (*static_cast<Functor*>(self))(); };
+		manage = [](Op op, void* self, void* other) {
+			Functor* functor = static_cast<Functor*>(self);
+			if (op == Op::Move)
+				::new (other) Functor(std::move(*functor));
+			functor->~Functor();
+		};
+	}
+	template<typename Functor, typename Fn>
+	void init(Fn&& fn, std::false_type) {
+		::new (static_cast<void*>(&storage)) Functor*(new Functor(std::forward<Fn>(fn)));
+		invoke = [](void* self) { (**static_cast<Functor**>(self))(); };
+		manage = [](Op op, void* self, void* other) {
+			Functor** functor = static_cast<Functor**>(self);
+			if (op == Op::Move)
+				::new (other) Functor*(*functor);
+			else
+				delete *functor;
+		};
+	}
+
+	void move_from(TaskFunction& other) noexcept {
+		if (!other.invoke)
+			return;
+		other.manage(Op::Move, &other.storage, &storage);
+		invoke = other.invoke;
+		manage = other.manage;
+		other.invoke = nullptr;
+		other.manage = nullptr;
+	}
+	void reset() noexcept {
+		if (manage)
+			manage(Op::Destroy, &storage, nullptr);
+		invoke = nullptr;
+		manage = nullptr;
+	}
+
+	typename std::aligned_storage<inline_size, alignof(std::max_align_t)>::type storage;
+	Invoke invoke;
+	Manage manage;
+};
+
+#endif
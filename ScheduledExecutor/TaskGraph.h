@@ -0,0 +1,171 @@
+#ifndef TASK_GRAPH_H
+#define TASK_GRAPH_H
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include "ThreadPool.h"
+
+// Граф зависимых задач. Узлы и ребра задаются заранее, затем граф
+// запускается на ThreadPool: узел ставится в пул, как только
+// завершилась последняя из его зависимостей. Для этого у каждого узла
+// есть атомарный счетчик незавершенных зависимостей, который
+// восстанавливается перед каждым запуском, так что повторный запуск
+// того же графа не выделяет память.
+class TaskGraph {
+public:
+	typedef size_t NodeID;
+
+	TaskGraph() = default;
+	TaskGraph(TaskGraph const &) = delete;
+	TaskGraph & operator = (TaskGraph const &) = delete;
+
+	// Добавляет узел. fn вызывается при каждом запуске графа.
+	template<typename Fn>
+	NodeID add(Fn&& fn) {
+		check_idle();
+		nodes.emplace_back(new Node(TaskFunction(std::forward<Fn>(fn))));
+		validated = false;
+		return nodes.size() - 1;
+	}
+	// Узел after запустится только после завершения узла before.
+	void precede(NodeID before, NodeID after) {
+		check_idle();
+		if (before >= nodes.size() || after >= nodes.size())
+			throw std::out_of_range("TaskGraph node does not exist.");
+		nodes[before]->successors.push_back(after);
+		++nodes[after]->dependencies;
+		validated = false;
+	}
+	size_t size() const { return nodes.size(); }
+
+	// Запускает граф и возвращает Future, который станет готовым после
+	// завершения всех узлов. Если узел бросил исключение, тела
+	// оставшихся узлов не выполняются, а Future хранит это исключение.
+	// Одновременно граф может выполняться только один раз.
+	Future<void> run_async(ThreadPool & pool);
+	// Запускает граф и ждет его завершения, выполняя задачи пула в
+	// вызывающем потоке, поэтому может вызываться изнутри задач пула.
+	void run(ThreadPool & pool);
+private:
+	struct Node {
+		explicit Node(TaskFunction&& fn) : fn(std::move(fn)), dependencies(0), remaining(0) { }
+		TaskFunction fn;
+		std::vector<NodeID> successors;
+		size_t dependencies;
+		std::atomic<size_t> remaining;
+	};
+
+	void check_idle() const {
+		if (running)
+			throw std::logic_error("TaskGraph is running.");
+	}
+	void validate();
+	void execute(NodeID id);
+	void schedule(NodeID id) {
+		pool->post_unbounded(ThreadPool::Priority::Normal, [this, id] { execute(id); });
+	}
+
+	std::vector<std::unique_ptr<Node>> nodes;
+	std::vector<NodeID> roots;
+	bool validated = false;
+	std::atomic<bool> running {false};
+	std::atomic<size_t> unfinished {0};
+	std::atomic<bool> failed {false};
+	std::exception_ptr error;
+	ThreadPool* pool = nullptr;
+	Promise<void> done;
+};
+
+// Проверяет граф на циклы алгоритмом Кана и запоминает корни.
+inline void TaskGraph::validate() {
+	roots.clear();
+	std::vector<size_t> indegree(nodes.size());
+	std::vector<NodeID> ready;
+	for (NodeID id = 0; id < nodes.size(); ++id) {
+		indegree[id] = nodes[id]->dependencies;
+		if (!indegree[id]) {
+			roots.push_back(id);
+			ready.push_back(id);
+		}
+	}
+	size_t visited = 0;
+	while (!ready.empty()) {
+		NodeID id = ready.back();
+		ready.pop_back();
+		++visited;
+		for (NodeID next : nodes[id]->successors)
+			if (--indegree[next] == 0)
+				ready.push_back(next);
+	}
+	if (visited != nodes.size())
+		throw std::invalid_argument("TaskGraph has a cycle.");
+	validated = true;
+}
+
+inline Future<void> TaskGraph::run_async(ThreadPool & pool) {
+	if (running.exchange(true))
+		throw std::logic_error("TaskGraph is running.");
+	try {
+		if (!validated)
+			validate();
+	} catch (...) {
+		running = false;
+		throw;
+	}
+	this->pool = &pool;
+	error = nullptr;
+	failed = false;
+	done = Promise<void>();
+	Future<void> res = done.get_future(pool.get_executor());
+	if (nodes.empty()) {
+		running = false;
+		done.set_value();
+		return res;
+	}
+	for (std::unique_ptr<Node>& node : nodes)
+		node->remaining.store(node->dependencies, std::memory_order_relaxed);
+	unfinished = nodes.size();
+	for (NodeID id : roots)
+		schedule(id);
+	return res;
+}
+
+inline void TaskGraph::execute(NodeID id) {
+	Node& node = *nodes[id];
+	if (!failed) {
+		try {
+			node.fn();
+		} catch (...) {
+			if (!failed.exchange(true))
+				error = std::current_exception();
+		}
+	}
+	for (NodeID next : node.successors)
+		if (nodes[next]->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			schedule(next);
+	if (unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		// После running = false граф можно запускать снова, поэтому все
+		// нужное для завершения этого запуска забирается заранее.
+		Promise<void> finished(std::move(done));
+		std::exception_ptr failure = error;
+		running = false;
+		if (failure)
+			finished.set_exception(failure);
+		else
+			finished.set_value();
+	}
+}
+
+inline void TaskGraph::run(ThreadPool & pool) {
+	Future<void> finished = run_async(pool);
+	while (!finished.is_ready())
+		if (!pool.try_run_one())
+			std::this_thread::yield();
+	finished.get();
+}
+
+#endif
@@ -2,77 +2,1163 @@
 #define THREAD_POOL_H
 
 #include <vector>
-#include <queue>
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
-#include <future>
 #include <functional>
 #include <stdexcept>
+#include "Future.h"
+#include "Metrics.h"
+#include "MPMCQueue.h"
+#include "RingDeque.h"
+#include "TaskFunction.h"
+#include "Topology.h"
 
 class ThreadPool {
 public:
-	ThreadPool(size_t);
+	// Дисциплина очереди задач.
+	//	Shared - одна общая очередь под одним мьютексом.
+	//	WorkStealing - у каждого потока своя дека. Задачи, поставленные
+	//	из потока пула, попадают в его деку, внешние задачи - в общую
+	//	очередь, а простаивающие потоки воруют задачи у остальных.
+	//	LockFree - задачи ставятся в ограниченное lock-free кольцо без
+	//	мьютекса; если кольцо заполнено, задача уходит в общую очередь.
+	//	ring_size задает размер кольца и должен быть степенью двойки.
+	enum class Mode { Shared, WorkStealing, LockFree };
+
+	// Привязка потоков к процессорам.
+	//	None - потоки не привязываются.
+	//	Compact - потоки занимают гиперпотоки одного ядра, затем соседние
+	//	ядра того же NUMA-узла.
+	//	Scatter - потоки раскладываются по узлам и ядрам по очереди.
+	//	List - поток i привязывается к процессору cpus[i % cpus.size()].
+	enum class Placement { None, Compact, Scatter, List };
+
+	// Полосы приоритета общей очереди. Потоки разбирают их начиная с
+	// High. Задачи с приоритетом, отличным от Normal, всегда идут в общую
+	// очередь, а в режимах WorkStealing и LockFree потоки проверяют ее
+	// раньше своих дек и кольца, если в полосе High есть задачи.
+	enum class Priority { High, Normal, Low };
+	static const size_t lane_count = 3;
+
+	// Поведение потока, для которого не нашлось задач.
+	//	Block - сразу засыпает на условной переменной. Подходит там, где
+	//	важно энергопотребление.
+	//	Spin - сначала крутится с инструкцией pause, затем уступает
+	//	процессор через yield и только потом засыпает. Бюджет ожидания
+	//	растет, если задачи приходили во время ожидания, и сокращается,
+	//	если поток все равно уснул, но не превышает spin_limit.
+	enum class Idle { Block, Spin };
+
+	// Порядок задач внутри полосы общей очереди.
+	//	Fifo - в порядке постановки.
+	//	Deadline - первой берется задача с самым ранним сроком (EDF). Срок
+	//	задачи, поставленной без него, - время постановки, поэтому
+	//	опоздавшая задача обгоняет свежие. Задачи с равным сроком, в том
+	//	числе задачи без срока из одной пачки, идут в порядке постановки.
+	//	Чтобы порядок соблюдался, в этом
+	//	режиме все задачи идут в общую очередь, минуя деки потоков и кольцо.
+	enum class Order { Fifo, Deadline };
+
+	// Что делать с задачей, для которой в ограниченной очереди нет места.
+	//	Block - ждать места не дольше block_timeout, затем бросить QueueFull.
+	//	CallerRuns - выполнить задачу в вызывающем потоке. Это замедляет
+	//	постановщика ровно настолько, насколько отстает пул.
+	//	Discard - отбросить задачу; ее Future получит broken_promise.
+	//	Throw - сразу бросить QueueFull.
+	// Поток самого пула никогда не ждет места: для него Block работает
+	// как CallerRuns, иначе все потоки могли бы ждать места, которое
+	// некому освободить. Продолжения Future ставятся без ограничения.
+	enum class Overflow { Block, CallerRuns, Discard, Throw };
+
+	class QueueFull : public std::runtime_error {
+	public:
+		QueueFull() : std::runtime_error("ThreadPool queue is full") { }
+	};
+
+	// Параметры пула. threads - число потоков, для эластичного пула -
+	// минимальное. Если max_threads больше threads, пул эластичный:
+	// новый поток запускается, когда задача ждет в очереди дольше
+	// spawn_after, а поток, простоявший без работы keep_alive,
+	// завершается, пока потоков больше threads.
+	struct Options {
+		size_t threads = 1;
+		Mode mode = Mode::Shared;
+		size_t ring_size = 1024;
+		size_t max_threads = 0;
+		std::chrono::milliseconds spawn_after {10};
+		std::chrono::milliseconds keep_alive {60000};
+		// Топология читается из sysfs. numa_queues работает в режиме
+		// WorkStealing: внешняя задача попадает в очередь узла
+		// постановщика, откуда потоки берут задачи в порядке постановки,
+		// а воруют потоки сначала из своего узла.
+		Placement placement = Placement::None;
+		std::vector<int> cpus;
+		bool numa_queues = false;
+		// Старение полос: непустую полосу пропускают не больше aging раз
+		// подряд, после чего из нее берется задача, даже если в более
+		// приоритетных полосах есть работа.
+		size_t aging = 16;
+		Idle idle = Idle::Block;
+		std::chrono::microseconds spin_limit {100};
+		Order order = Order::Fifo;
+		// Допустимое опоздание начала задачи относительно ее срока для
+		// каждой полосы, 0 - без ограничения. Задачи, начавшиеся позже,
+		// считаются в Metrics::slo_violations своей полосы.
+		std::chrono::microseconds slo[lane_count] = {};
+		// Наибольшее число поставленных, но еще не начатых задач;
+		// 0 - без ограничения.
+		size_t capacity = 0;
+		Overflow overflow = Overflow::Block;
+		std::chrono::milliseconds block_timeout {1000};
+		// Сбор метрик: два чтения часов на задачу и запись в слот
+		// выполняющего потока.
+		bool metrics = true;
+	};
+
+	// Метрики одного потока: сколько задач выполнено, сколько времени
+	// ушло на задачи и на ожидание работы. Задачи, выполненные через
+	// try_run_one изнутри другой задачи, входят в busy обеих.
+	struct WorkerMetrics {
+		uint64_t tasks;
+		std::chrono::nanoseconds busy;
+		std::chrono::nanoseconds idle;
+	};
+	// Снимок метрик пула. workers - по элементу на слот потока и
+	// последний элемент для задач, выполненных сторонними потоками через
+	// try_run_one. depth - сколько задач сейчас ждет в очередях.
+	// queue_wait - время от постановки до начала выполнения, run_time -
+	// время выполнения, lateness - на сколько начало выполнения позже
+	// срока задачи, в наносекундах. Для задачи без срока lateness
+	// совпадает с queue_wait. slo_violations - сколько задач каждой
+	// полосы опоздало больше Options::slo.
+	struct Metrics {
+		std::vector<WorkerMetrics> workers;
+		size_t depth;
+		Histogram::Snapshot queue_wait;
+		Histogram::Snapshot run_time;
+		Histogram::Snapshot lateness;
+		uint64_t slo_violations[lane_count];
+	};
+
+	ThreadPool(size_t, Mode mode = Mode::Shared, size_t ring_size = 1024);
+	explicit ThreadPool(Options const & options);
+	// Ставит задачу в очередь. Задача вместе с аргументами хранится в
+	// TaskFunction, а результат передается через Future, общее состояние
+	// которого берется из пула блоков, так что небольшая задача ставится
+	// и выполняется без выделения памяти в куче.
 	template<typename Fn, typename... Args>
 	auto enqueue(Fn&& fn, Args&&... args)
-		->std::future<typename std::result_of<Fn(Args...)>::type>;
+		->Future<typename std::result_of<Fn(Args...)>::type>;
+	template<typename Fn, typename... Args>
+	auto enqueue(Priority priority, Fn&& fn, Args&&... args)
+		->Future<typename std::result_of<Fn(Args...)>::type>;
+	// Ставит задачу, результат которой не нужен: без Future и общего
+	// состояния. Исключение такой задачи передать некуда: пул его
+	// перехватывает и считает в failed(), а поток продолжает работу.
+	template<typename Fn, typename... Args>
+	void post(Fn&& fn, Args&&... args);
+	template<typename Fn, typename... Args>
+	void post(Priority priority, Fn&& fn, Args&&... args);
+	// Ставит задачу, только если в очереди есть место, не применяя
+	// политику переполнения. Возвращает false, если задача не поставлена.
+	template<typename Fn, typename... Args>
+	bool try_post(Fn&& fn, Args&&... args);
+	template<typename Fn, typename... Args>
+	bool try_post(Priority priority, Fn&& fn, Args&&... args);
+	// Ставит задачу в обход ограничения очереди, как продолжения Future:
+	// такая задача не отбрасывается и не отклоняется, а постановщик не
+	// ждет места. Нужна для задач, которые кто-то ждет, - половин
+	// fork_join, узлов TaskGraph, продолжений сопрограмм. Потерянная
+	// задача оставила бы ждущего навсегда.
+	template<typename Fn, typename... Args>
+	void post_unbounded(Priority priority, Fn&& fn, Args&&... args);
+	// Как post, но со сроком, к которому задача должна начаться. По сроку
+	// упорядочивает полосу режим Order::Deadline, от него же считается
+	// опоздание в метриках.
+	template<typename Fn, typename... Args>
+	void post_by(std::chrono::steady_clock::time_point deadline, Priority priority, Fn&& fn, Args&&... args);
+	// Ставят все задачи из диапазона [first, last) под одной блокировкой
+	// и будят столько потоков, сколько задач поставлено (но не больше
+	// размера пула). Функторы из диапазона копируются; чтобы их
+	// переместить, передайте std::make_move_iterator.
+	template<typename It>
+	auto enqueue_bulk(It first, It last)
+		->std::vector<Future<typename std::result_of<
+			typename std::iterator_traits<It>::value_type()>::type>>;
+	template<typename It>
+	void post_bulk(It first, It last);
+	template<typename It>
+	void post_bulk(Priority priority, It first, It last);
+	// Ставит задачи с начала диапазона, сколько их помещается в очередь,
+	// не применяя политику переполнения, и возвращает их число. Функторы,
+	// для которых места не нашлось, не трогаются.
+	template<typename It>
+	size_t try_post_bulk(Priority priority, It first, It last);
+	// То же со сроком каждой задачи: deadline_of(*it) вызывается до того,
+	// как функтор перемещается в очередь.
+	template<typename It, typename DeadlineOf>
+	size_t try_post_bulk(Priority priority, It first, It last, DeadlineOf deadline_of);
+	// Берет из очереди одну задачу и выполняет ее в вызывающем потоке.
+	// Возвращает false, если задач нет. Нужна, чтобы поток, ждущий
+	// результатов других задач, помогал их выполнять, а не блокировался.
+	bool try_run_one();
+	// Ожидаемый объект для сопрограмм C++20: co_await pool.schedule()
+	// приостанавливает сопрограмму и продолжает ее в потоке пула.
+	// Заголовок <coroutine> не нужен: дескриптор сопрограммы
+	// принимается шаблоном. Если пул остановлен, исключение бросается
+	// из co_await.
+	class ScheduleAwaiter {
+	public:
+		ScheduleAwaiter(ThreadPool* pool, Priority priority) : pool(pool), priority(priority) { }
+		bool await_ready() const { return false; }
+		template<typename Handle>
+		void await_suspend(Handle handle) {
+			pool->post_unbounded(priority, [handle]() mutable { handle.resume(); });
+		}
+		void await_resume() const { }
+	private:
+		ThreadPool* pool;
+		Priority priority;
+	};
+	ScheduleAwaiter schedule(Priority priority = Priority::Normal) {
+		return ScheduleAwaiter(this, priority);
+	}
+	// Исполнитель для продолжений Future: ставит задачу в этот пул.
+	// Future, возвращаемые enqueue, уже привязаны к нему.
+	Executor get_executor() {
+		Executor executor;
+		executor.context = this;
+		executor.post = &ThreadPool::post_continuation;
+		return executor;
+	}
+
+	// Текущее число потоков и число запущенных сверх начальных и
+	// завершенных по простою потоков эластичного пула.
+	size_t size() const { return threads; }
+	// Сколько потоков сейчас спит в ожидании работы. Потоки, которые
+	// крутятся в режиме Idle::Spin, сюда не входят.
+	size_t idle_threads() const { return sleeping; }
+	size_t spawned() const { return spawn_count; }
+	size_t retired() const { return retire_count; }
+	// Заполненность ограниченной очереди: сколько задач ждет сейчас,
+	// наибольшее их число за время жизни пула, сколько раз задаче не
+	// хватило места и сколько задач отброшено или отклонено. Для пула
+	// без ограничения не ведутся.
+	size_t queued() const { return queued_count; }
+	size_t high_water() const { return high_water_mark; }
+	size_t overflows() const { return overflow_count; }
+	size_t rejected() const { return reject_count; }
+	// Сколько задач завершилось исключением. Задачи из enqueue сюда не
+	// попадают: их исключение получает Future.
+	size_t failed() const { return fail_count; }
+	// Сколько потоков не удалось привязать к процессору по плану
+	// размещения: такие потоки работают без привязки.
+	size_t pin_failures() const { return pin_fail_count; }
+	// Собирает метрики, не останавливая потоки: значения, записанные
+	// во время сбора, могут в снимок не попасть.
+	Metrics metrics() const;
 	~ThreadPool();
 private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct QueuedTask {
+		TaskFunction fn;
+		Clock::time_point enqueued;
+		Clock::time_point deadline;
+		Priority priority;
+		// Порядковый номер в полосе Order::Deadline: из задач с равным
+		// сроком первой берется поставленная раньше.
+		uint64_t sequence;
+	};
+	// Срок, которого нет: задаче назначается время постановки.
+	struct NoDeadline {
+		template<typename T>
+		Clock::time_point operator()(T const &) const { return Clock::time_point(); }
+	};
+	struct WorkerQueue {
+		RingDeque<QueuedTask> tasks;
+		std::mutex mutex;
+	};
+	// Метрики пишет только поток своего слота, поэтому обновление - это
+	// запись в память без атомарных операций чтения-модификации-записи.
+	// Слоты выделяются отдельно и отбиты с обеих сторон, чтобы не делить
+	// кэш-линию с соседними данными.
+	struct MetricsSlot {
+		char pad0[64];
+		Counter tasks;
+		Counter busy;
+		Counter idle;
+		Histogram wait;
+		Histogram run;
+		Histogram lateness;
+		Counter violations[lane_count];
+		char pad1[64];
+	};
+	struct WorkerContext {
+		ThreadPool* pool;
+		size_t index;
+	};
+	static WorkerContext& context() {
+		static thread_local WorkerContext ctx {nullptr, 0};
+		return ctx;
+	}
+	static Options make_options(size_t threads, Mode mode, size_t ring_size);
+	// Продолжения ставятся и во время остановки пула: задача, чье
+	// завершение их породило, еще выполняется, и потоки их дождутся.
+	static void post_continuation(void* pool, TaskFunction&& task) {
+		ThreadPool* self = static_cast<ThreadPool*>(pool);
+		if (self->options.capacity)
+			self->charge(1);
+		self->place(std::move(task), Priority::Normal, Clock::time_point());
+	}
+	static QueuedTask make_task(TaskFunction&& fn, Clock::time_point now, Clock::time_point deadline, Priority priority) {
+		return QueuedTask {std::move(fn), now, deadline == Clock::time_point() ? now : deadline, priority, 0};
+	}
+	static bool later(QueuedTask const & a, QueuedTask const & b) {
+		if (a.deadline != b.deadline)
+			return b.deadline < a.deadline;
+		return b.sequence < a.sequence;
+	}
+	void plan_placement(size_t slots);
+
+	bool elastic() const { return options.max_threads > options.threads; }
+	bool has_tasks() const { return pending > 0 || (ring && !ring->empty()); }
+	// Задачи не в полосе Normal и все задачи в режиме Order::Deadline
+	// идут только в общую очередь.
+	bool shared_only(Priority priority) const {
+		return priority != Priority::Normal || options.order == Order::Deadline;
+	}
+	void push(TaskFunction task, Priority priority = Priority::Normal,
+		Clock::time_point deadline = Clock::time_point());
+	void push_shared(QueuedTask&& task);
+	bool lane_empty(size_t lane) const;
+	QueuedTask pop_lane(size_t lane);
+	void push_bulk(std::vector<TaskFunction>& batch, Priority priority = Priority::Normal);
+	void place(TaskFunction fn, Priority priority, Clock::time_point deadline);
+	void place_bulk(TaskFunction* batch, size_t n, Priority priority = Priority::Normal,
+		Clock::time_point const * deadlines = nullptr);
+	size_t reserve(size_t n);
+	void charge(size_t n);
+	void raise_high_water(size_t n);
+	void release();
+	bool admit(TaskFunction& fn);
+	bool wait_for_space();
+	void run(size_t index);
+	Clock::time_point execute(QueuedTask& task, size_t slot, Clock::time_point start = Clock::time_point());
+	void invoke(TaskFunction& fn);
+	bool pop(size_t index, QueuedTask& task);
+	bool pop_local(size_t index, QueuedTask& task);
+	bool pop_shared(QueuedTask& task);
+	bool steal(size_t index, QueuedTask& task);
+	bool pop_external(QueuedTask& task);
+	static const size_t no_slot = size_t(-1);
+	size_t target_slot();
+	bool spin(Clock::duration& budget);
+	bool park(size_t index);
+	static void cpu_relax();
+	bool retire(size_t index);
+	void spawn();
+	void check_backlog();
+	void wake(size_t n);
+	void notify(size_t n);
+
+	Options options;
+	Mode mode;
 	std::vector<std::thread> workers;
-	std::queue<std::function<void()>> tasks;
+	std::vector<char> active;
+	std::mutex workers_mutex;
+	std::vector<std::unique_ptr<WorkerQueue>> local;
+	// Процессор и узел каждого слота и порядок обхода жертв при
+	// воровстве. При numa_queues за деками потоков в local лежат
+	// очереди узлов, первая из них - с номером node_queues.
+	std::vector<int> worker_cpu;
+	std::vector<int> worker_node;
+	std::vector<std::vector<size_t>> victims;
+	size_t node_queues = no_slot;
+	std::unique_ptr<MPMCQueue<QueuedTask>> ring;
+	RingDeque<QueuedTask> lanes[lane_count];
+	// Полосы в режиме Order::Deadline: кучи с ближайшим сроком в корне.
+	std::vector<QueuedTask> deadline_lanes[lane_count];
+	uint64_t next_sequence = 0;
+	size_t skipped[lane_count] = {};
 	std::mutex queue_mutex;
 	std::condition_variable condition;
+	// Число задач в очередях под мьютексами и число спящих потоков.
+	// Нужны, чтобы постановка в локальную деку или в кольцо не брала
+	// queue_mutex, пока все потоки заняты.
+	std::atomic<size_t> pending {0};
+	std::atomic<size_t> sleeping {0};
+	std::atomic<size_t> urgent {0};
+	std::atomic<size_t> threads {0};
+	std::atomic<size_t> spawn_count {0};
+	std::atomic<size_t> retire_count {0};
+	std::atomic<size_t> fail_count {0};
+	std::atomic<size_t> pin_fail_count {0};
+	// Время, когда задача последний раз была взята из очереди. Если
+	// все потоки заняты, а очередь давно не двигается, пул растет.
+	std::atomic<Clock::rep> last_pop {0};
+	// Учет места в ограниченной очереди. blocked - число постановщиков,
+	// ждущих места: только при них снятие задачи будит space.
+	std::atomic<size_t> queued_count {0};
+	std::atomic<size_t> high_water_mark {0};
+	std::atomic<size_t> overflow_count {0};
+	std::atomic<size_t> reject_count {0};
+	std::atomic<size_t> blocked {0};
+	std::mutex space_mutex;
+	std::condition_variable space;
+	// Слоты метрик потоков и последний - общий для сторонних потоков,
+	// который пишется под external_mutex.
+	std::vector<std::unique_ptr<MetricsSlot>> slot_metrics;
+	std::mutex external_mutex;
     std::atomic<bool> stop {false};
 };
 
-inline ThreadPool::ThreadPool(size_t threads) {
-	if (!threads)
+inline ThreadPool::Options ThreadPool::make_options(size_t threads, Mode mode, size_t ring_size) {
+	Options options;
+	options.threads = threads;
+	options.mode = mode;
+	options.ring_size = ring_size;
+	return options;
+}
+
+inline ThreadPool::ThreadPool(size_t threads, Mode mode, size_t ring_size)
+	: ThreadPool(make_options(threads, mode, ring_size)) { }
+
+inline ThreadPool::ThreadPool(Options const & options) : options(options), mode(options.mode) {
+	if (!options.threads)
 		throw std::invalid_argument("Pool size can not be 0.");
-	for (size_t i = 0; i<threads; ++i)
-		workers.emplace_back(
-		[this]
+	size_t slots = std::max(options.threads, options.max_threads);
+	if (mode == Mode::WorkStealing)
+		for (size_t i = 0; i<slots; ++i)
+			local.emplace_back(new WorkerQueue);
+	if (mode == Mode::LockFree)
+		ring.reset(new MPMCQueue<QueuedTask>(options.ring_size));
+	if (options.numa_queues && mode != Mode::WorkStealing)
+		throw std::invalid_argument("NUMA queues require Mode::WorkStealing.");
+	if (options.numa_queues) {
+		node_queues = local.size();
+		for (size_t i = 0; i < Topology::get().nodes(); ++i)
+			local.emplace_back(new WorkerQueue);
+	}
+	if (options.placement == Placement::List && options.cpus.empty())
+		throw std::invalid_argument("CPU list is empty.");
+	plan_placement(slots);
+	if (options.metrics)
+		for (size_t i = 0; i <= slots; ++i)
+			slot_metrics.emplace_back(new MetricsSlot);
+	last_pop = Clock::now().time_since_epoch().count();
+	workers.resize(slots);
+	active.resize(slots, 0);
+	std::lock_guard<std::mutex> lock(workers_mutex);
+	for (size_t i = 0; i<options.threads; ++i) {
+		active[i] = 1;
+		++threads;
+		workers[i] = std::thread(&ThreadPool::run, this, i);
+	}
+}
+
+inline void ThreadPool::plan_placement(size_t slots) {
+	Topology const & topology = Topology::get();
+	std::vector<int> plan;
+	switch (options.placement) {
+	case Placement::Compact:
+		plan = topology.compact();
+		break;
+	case Placement::Scatter:
+		plan = topology.scatter();
+		break;
+	case Placement::List:
+		plan = options.cpus;
+		break;
+	default:
+		break;
+	}
+	worker_cpu.assign(slots, -1);
+	worker_node.assign(slots, 0);
+	for (size_t i = 0; i < slots && !plan.empty(); ++i) {
+		worker_cpu[i] = plan[i % plan.size()];
+		worker_node[i] = topology.node_of(worker_cpu[i]);
+	}
+	// Сначала очередь своего узла и соседи по узлу, затем остальные,
+	// начиная со следующего слота, чтобы воры не набрасывались на одну
+	// и ту же жертву.
+	victims.resize(slots);
+	for (size_t i = 0; i < slots; ++i) {
+		for (int same = 1; same >= 0; --same) {
+			if (node_queues != no_slot)
+				for (size_t node = 0; node < topology.nodes(); ++node)
+					if ((int(node) == worker_node[i]) == (same == 1))
+						victims[i].push_back(node_queues + node);
+			for (size_t j = 1; j < slots; ++j) {
+				size_t victim = (i + j) % slots;
+				if ((worker_node[victim] == worker_node[i]) == (same == 1))
+					victims[i].push_back(victim);
+			}
+		}
+	}
+}
+
+inline void ThreadPool::run(size_t index) {
+	context() = WorkerContext {this, index};
+	if (worker_cpu[index] >= 0 && !Topology::pin(worker_cpu[index]))
+		++pin_fail_count;
+	Clock::duration budget = options.spin_limit / 4;
+	// Момент, когда поток освободился: конец последней задачи или
+	// простоя. С него отсчитываются и следующая задача, и простой, так
+	// что на задачу приходится одно чтение часов.
+	Clock::time_point mark;
+	if (options.metrics)
+		mark = Clock::now();
+	for (;;) {
+		QueuedTask task;
+		if (!pop(index, task)) {
+			bool alive = (options.idle == Idle::Spin && spin(budget)) || park(index);
+			if (options.metrics) {
+				Clock::time_point now = Clock::now();
+				slot_metrics[index]->idle.add(std::chrono::nanoseconds(now - mark).count());
+				mark = now;
+			}
+			if (!alive)
+				return;
+			continue;
+		}
+		if (options.capacity)
+			release();
+		if (elastic()) {
+			Clock::time_point now = Clock::now();
+			last_pop = now.time_since_epoch().count();
+			if (now - task.enqueued > options.spawn_after && sleeping == 0 && has_tasks())
+				spawn();
+		}
+		mark = execute(task, index, mark);
+	}
+}
+
+// Выполняет задачу и, если метрики включены, записывает их в слот slot.
+// start - начало отсчета или пустое значение, чтобы прочитать часы.
+// Возвращает время окончания задачи.
+inline ThreadPool::Clock::time_point ThreadPool::execute(QueuedTask& task, size_t slot, Clock::time_point start) {
+	if (!options.metrics) {
+		invoke(task.fn);
+		return start;
+	}
+	if (start == Clock::time_point())
+		start = Clock::now();
+	start = std::max(start, task.enqueued);
+	invoke(task.fn);
+	Clock::time_point end = Clock::now();
+	MetricsSlot& counters = *slot_metrics[slot];
+	std::unique_lock<std::mutex> lock(external_mutex, std::defer_lock);
+	if (slot == slot_metrics.size() - 1)
+		lock.lock();
+	counters.wait.record(start - task.enqueued);
+	counters.run.record(end - start);
+	counters.lateness.record(start - task.deadline);
+	std::chrono::microseconds slo = options.slo[size_t(task.priority)];
+	if (slo.count() && start - task.deadline > slo)
+		counters.violations[size_t(task.priority)].add(1);
+	counters.tasks.add(1);
+	counters.busy.add(std::chrono::nanoseconds(end - start).count());
+	return end;
+}
+
+// Исключение задачи не должно выйти из потока пула: иначе
+// std::terminate завершит весь процесс.
+inline void ThreadPool::invoke(TaskFunction& fn) {
+	try {
+		fn();
+	} catch (...) {
+		++fail_count;
+	}
+}
+
+inline ThreadPool::Metrics ThreadPool::metrics() const {
+	Metrics res;
+	res.depth = pending + (ring ? ring->size() : 0);
+	for (size_t lane = 0; lane < lane_count; ++lane)
+		res.slo_violations[lane] = 0;
+	for (std::unique_ptr<MetricsSlot> const & slot : slot_metrics) {
+		WorkerMetrics worker {slot->tasks.get(), std::chrono::nanoseconds(slot->busy.get()),
+			std::chrono::nanoseconds(slot->idle.get())};
+		res.workers.push_back(worker);
+		slot->wait.collect(res.queue_wait);
+		slot->run.collect(res.run_time);
+		slot->lateness.collect(res.lateness);
+		for (size_t lane = 0; lane < lane_count; ++lane)
+			res.slo_violations[lane] += slot->violations[lane].get();
+	}
+	return res;
+}
+
+inline bool ThreadPool::pop(size_t index, QueuedTask& task) {
+	switch (mode) {
+	case Mode::WorkStealing:
+		return (urgent > 0 && pop_shared(task))
+			|| pop_local(index, task) || pop_shared(task) || steal(index, task);
+	case Mode::LockFree:
+		return (urgent > 0 && pop_shared(task))
+			|| ring->try_pop(task) || (pending > 0 && pop_shared(task));
+	default:
+		return pop_shared(task);
+	}
+}
+
+inline void ThreadPool::cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield");
+#else
+	std::this_thread::yield();
+#endif
+}
+
+// Ждет задачу, не засыпая: первую половину бюджета с pause, вторую -
+// уступая процессор. Возвращает true, если задача появилась. После
+// остановки пула возвращает false: решение о выходе потока принимает
+// park.
+inline bool ThreadPool::spin(Clock::duration& budget) {
+	const Clock::duration floor = std::chrono::microseconds(1);
+	const Clock::duration limit = options.spin_limit;
+	Clock::time_point start = Clock::now();
+	Clock::time_point yield_from = start + budget / 2;
+	Clock::time_point deadline = start + budget;
+	bool yielding = false;
+	for (unsigned i = 1; ; ++i) {
+		if (stop)
+			return false;
+		if (has_tasks()) {
+			budget = std::min<Clock::duration>(budget * 2, limit);
+			return true;
+		}
+		if (yielding || i % 64 == 0) {
+			Clock::time_point now = Clock::now();
+			if (now >= deadline)
+				break;
+			yielding = now >= yield_from;
+		}
+		if (yielding)
+			std::this_thread::yield();
+		else
+			cpu_relax();
+	}
+	budget = std::max<Clock::duration>(budget / 2, floor);
+	return false;
+}
+
+// Засыпает, пока не появятся задачи. Возвращает false, если потоку
+// пора завершиться: пул остановлен и очереди пусты, или поток
+// эластичного пула простоял без работы keep_alive.
+inline bool ThreadPool::park(size_t index) {
+	std::unique_lock<std::mutex> lock(queue_mutex);
+	auto ready = [this] { return stop || has_tasks(); };
+	++sleeping;
+	bool woken = true;
+	if (elastic())
+		woken = condition.wait_for(lock, options.keep_alive, ready);
+	else
+		condition.wait(lock, ready);
+	--sleeping;
+	if (stop && !has_tasks())
+		return false;
+	return woken || !retire(index);
+}
+
+// Вызывается под queue_mutex.
+inline bool ThreadPool::retire(size_t index) {
+	std::lock_guard<std::mutex> lock(workers_mutex);
+	if (stop || threads <= options.threads)
+		return false;
+	active[index] = 0;
+	--threads;
+	++retire_count;
+	return true;
+}
+
+inline void ThreadPool::spawn() {
+	std::lock_guard<std::mutex> lock(workers_mutex);
+	if (stop || threads >= options.max_threads)
+		return;
+	size_t index = std::find(active.begin(), active.end(), 0) - active.begin();
+	// Поток, ранее завершившийся в этом слоте, уже вышел из run.
+	if (workers[index].joinable())
+		workers[index].join();
+	active[index] = 1;
+	++threads;
+	++spawn_count;
+	workers[index] = std::thread(&ThreadPool::run, this, index);
+}
+
+// Все потоки заняты, а из очереди давно ничего не брали: задачи ждут
+// дольше spawn_after, пора добавить поток.
+inline void ThreadPool::check_backlog() {
+	if (!elastic() || sleeping > 0)
+		return;
+	Clock::duration idle = Clock::now().time_since_epoch() - Clock::duration(last_pop.load());
+	if (idle > options.spawn_after)
+		spawn();
+}
+
+inline bool ThreadPool::pop_local(size_t index, QueuedTask& task) {
+	WorkerQueue& queue = *local[index];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.tasks.empty())
+		return false;
+	// Свои задачи берем с конца: они свежие и их данные еще в кэше.
+	task = queue.tasks.pop_back();
+	--pending;
+	return true;
+}
+
+inline bool ThreadPool::pop_shared(QueuedTask& task) {
+	std::lock_guard<std::mutex> lock(queue_mutex);
+	size_t lane = 0;
+	while (lane < lane_count && lane_empty(lane))
+		++lane;
+	if (lane == lane_count)
+		return false;
+	for (size_t i = lane + 1; i < lane_count; ++i) {
+		if (lane_empty(i))
+			continue;
+		if (++skipped[i] > options.aging) {
+			lane = i;
+			break;
+		}
+	}
+	skipped[lane] = 0;
+	task = pop_lane(lane);
+	if (lane == size_t(Priority::High))
+		--urgent;
+	--pending;
+	return true;
+}
+
+// Вызывается под queue_mutex.
+inline void ThreadPool::push_shared(QueuedTask&& task) {
+	size_t lane = size_t(task.priority);
+	if (options.order == Order::Deadline) {
+		task.sequence = next_sequence++;
+		deadline_lanes[lane].push_back(std::move(task));
+		std::push_heap(deadline_lanes[lane].begin(), deadline_lanes[lane].end(), &ThreadPool::later);
+	} else {
+		lanes[lane].push_back(std::move(task));
+	}
+	if (lane == size_t(Priority::High))
+		++urgent;
+	++pending;
+}
+
+// Вызывается под queue_mutex.
+inline bool ThreadPool::lane_empty(size_t lane) const {
+	return options.order == Order::Deadline ? deadline_lanes[lane].empty() : lanes[lane].empty();
+}
+
+// Вызывается под queue_mutex.
+inline ThreadPool::QueuedTask ThreadPool::pop_lane(size_t lane) {
+	if (options.order != Order::Deadline)
+		return lanes[lane].pop_front();
+	std::vector<QueuedTask>& heap = deadline_lanes[lane];
+	std::pop_heap(heap.begin(), heap.end(), &ThreadPool::later);
+	QueuedTask task = std::move(heap.back());
+	heap.pop_back();
+	return task;
+}
+
+inline bool ThreadPool::steal(size_t index, QueuedTask& task) {
+	for (size_t i : victims[index]) {
+		WorkerQueue& victim = *local[i];
+		std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+		if (!lock.owns_lock() || victim.tasks.empty())
+			continue;
+		task = victim.tasks.pop_front();
+		--pending;
+		return true;
+	}
+	return false;
+}
+
+// Снимает задачу для потока, не принадлежащего пулу.
+inline bool ThreadPool::pop_external(QueuedTask& task) {
+	if ((pending > 0 && pop_shared(task)) || (ring && ring->try_pop(task)))
+		return true;
+	for (std::unique_ptr<WorkerQueue>& queue : local) {
+		std::unique_lock<std::mutex> lock(queue->mutex, std::try_to_lock);
+		if (!lock.owns_lock() || queue->tasks.empty())
+			continue;
+		task = queue->tasks.pop_front();
+		--pending;
+		return true;
+	}
+	return false;
+}
+
+inline bool ThreadPool::try_run_one() {
+	WorkerContext& ctx = context();
+	QueuedTask task;
+	if (!(ctx.pool == this ? pop(ctx.index, task) : pop_external(task)))
+		return false;
+	if (options.capacity)
+		release();
+	execute(task, ctx.pool == this ? ctx.index : slot_metrics.size() - 1);
+	return true;
+}
+
+inline void ThreadPool::notify(size_t n) {
+	if (n >= threads)
+		condition.notify_all();
+	else
+		while (n--)
+			condition.notify_one();
+}
+
+inline void ThreadPool::wake(size_t n) {
+	// Поток, уснувший после проверки pending, держал queue_mutex,
+	// поэтому захват мьютекса гарантирует, что он уже в wait.
+	if (sleeping == 0)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+	}
+	notify(n);
+}
+
+// Дека, в которую нужно положить задачу в режиме WorkStealing: своя
+// для потока пула, очередь узла постановщика при numa_queues, иначе
+// no_slot - задача идет в общую очередь. Очередь узла не чья-то дека:
+// ее с конца никто не снимает, и внешние задачи идут по очереди.
+inline size_t ThreadPool::target_slot() {
+	if (mode != Mode::WorkStealing)
+		return no_slot;
+	WorkerContext& ctx = context();
+	if (ctx.pool == this)
+		return ctx.index;
+	if (node_queues == no_slot)
+		return no_slot;
+	return node_queues + Topology::get().current_node();
+}
+
+// Занимает место для n задач, сколько поместится. Возвращает, для
+// скольких задач место занято.
+inline size_t ThreadPool::reserve(size_t n) {
+	size_t current = queued_count.load();
+	size_t taken;
+	do {
+		size_t room = current < options.capacity ? options.capacity - current : 0;
+		taken = std::min(n, room);
+		if (!taken)
+			return 0;
+	} while (!queued_count.compare_exchange_weak(current, current + taken));
+	raise_high_water(current + taken);
+	return taken;
+}
+
+// Учитывает задачи, которые ставятся независимо от ограничения.
+inline void ThreadPool::charge(size_t n) {
+	raise_high_water(queued_count += n);
+}
+
+inline void ThreadPool::raise_high_water(size_t n) {
+	size_t seen = high_water_mark.load(std::memory_order_relaxed);
+	while (n > seen && !high_water_mark.compare_exchange_weak(seen, n, std::memory_order_relaxed))
+		;
+}
+
+inline void ThreadPool::release() {
+	--queued_count;
+	// Постановщик увеличивает blocked под space_mutex до проверки места,
+	// поэтому он либо увидит освободившееся место, либо уже ждет.
+	if (blocked > 0) {
+		std::lock_guard<std::mutex> lock(space_mutex);
+		space.notify_one();
+	}
+}
+
+// Применяет политику переполнения к задаче, для которой нет места.
+// Возвращает true, если место все же нашлось и задачу нужно поставить,
+// и false, если задача уже выполнена или отброшена.
+inline bool ThreadPool::admit(TaskFunction& fn) {
+	if (reserve(1))
+		return true;
+	++overflow_count;
+	Overflow policy = options.overflow;
+	if (policy == Overflow::Block && context().pool == this)
+		policy = Overflow::CallerRuns;
+	switch (policy) {
+	case Overflow::Block:
+		if (wait_for_space())
+			return true;
+		break;
+	case Overflow::CallerRuns:
+		fn();
+		return false;
+	case Overflow::Discard:
+		++reject_count;
+		fn = TaskFunction();
+		return false;
+	default:
+		break;
+	}
+	++reject_count;
+	throw QueueFull();
+}
+
+inline bool ThreadPool::wait_for_space() {
+	std::unique_lock<std::mutex> lock(space_mutex);
+	++blocked;
+	bool reserved = space.wait_for(lock, options.block_timeout, [this] { return reserve(1) == 1; });
+	--blocked;
+	return reserved;
+}
+
+inline void ThreadPool::push(TaskFunction fn, Priority priority, Clock::time_point deadline) {
+	if (options.capacity && !admit(fn))
+		return;
+	place(std::move(fn), priority, deadline);
+}
+
+inline void ThreadPool::place(TaskFunction fn, Priority priority, Clock::time_point deadline) {
+	QueuedTask task = make_task(std::move(fn), Clock::now(), deadline, priority);
+	check_backlog();
+	size_t slot = shared_only(priority) ? no_slot : target_slot();
+	if (slot != no_slot) {
+		WorkerQueue& queue = *local[slot];
+		++pending;
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(std::move(task));
+		}
+		wake(1);
+		return;
+	}
+	if (mode == Mode::LockFree && !shared_only(priority)
+		&& ring->try_push(std::move(task))) {
+		wake(1);
+		return;
+	}
 	{
-		for (;;) {
-			std::function<void()> task;
-			{
-				std::unique_lock<std::mutex> lock(this->queue_mutex);
-				this->condition.wait(lock, [this] { 
-					return this->stop || !this->tasks.empty(); });
-				if (this->stop && this->tasks.empty())
-					return;
-				task = std::move(this->tasks.front());
-				this->tasks.pop();
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		push_shared(std::move(task));
+	}
+	condition.notify_one();
+}
+
+// В ограниченную очередь пачка ставится частями, на сколько хватает
+// места, а к задаче, для которой места нет, применяется политика
+// переполнения.
+inline void ThreadPool::push_bulk(std::vector<TaskFunction>& batch, Priority priority) {
+	if (!options.capacity) {
+		place_bulk(batch.data(), batch.size(), priority);
+		return;
+	}
+	size_t done = 0;
+	while (done < batch.size()) {
+		size_t n = reserve(batch.size() - done);
+		if (n) {
+			place_bulk(&batch[done], n, priority);
+			done += n;
+			continue;
+		}
+		if (admit(batch[done]))
+			place_bulk(&batch[done], 1, priority);
+		++done;
+	}
+}
+
+// deadlines - сроки задач пачки или nullptr, если сроков нет.
+inline void ThreadPool::place_bulk(TaskFunction* batch, size_t n, Priority priority,
+	Clock::time_point const * deadlines) {
+	if (!n)
+		return;
+	Clock::time_point now = Clock::now();
+	check_backlog();
+	size_t slot = shared_only(priority) ? no_slot : target_slot();
+	if (slot != no_slot) {
+		WorkerQueue& queue = *local[slot];
+		pending += n;
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			for (size_t i = 0; i < n; ++i)
+				queue.tasks.push_back(make_task(std::move(batch[i]), now,
+					deadlines ? deadlines[i] : Clock::time_point(), priority));
+		}
+		wake(n);
+		return;
+	}
+	size_t pushed = 0;
+	if (mode == Mode::LockFree && !shared_only(priority)) {
+		while (pushed < n) {
+			QueuedTask task = make_task(std::move(batch[pushed]), now,
+				deadlines ? deadlines[pushed] : Clock::time_point(), priority);
+			if (!ring->try_push(std::move(task))) {
+				batch[pushed] = std::move(task.fn);
+				break;
 			}
-			task();
+			++pushed;
+		}
+		if (pushed == n) {
+			wake(pushed);
+			return;
 		}
 	}
-	);
+	{
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		for (size_t i = pushed; i < n; ++i)
+			push_shared(make_task(std::move(batch[i]), now,
+				deadlines ? deadlines[i] : Clock::time_point(), priority));
+	}
+	notify(n);
 }
 
 template<typename Fn, typename... Args>
 auto ThreadPool::enqueue(Fn&& fn, Args&&... args)
--> std::future<typename std::result_of<Fn(Args...)>::type> {
+-> Future<typename std::result_of<Fn(Args...)>::type> {
+	return enqueue(Priority::Normal, std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+template<typename Fn, typename... Args>
+auto ThreadPool::enqueue(Priority priority, Fn&& fn, Args&&... args)
+-> Future<typename std::result_of<Fn(Args...)>::type> {
 	using return_type = typename std::result_of<Fn(Args...)>::type;
 
-	auto task = std::make_shared<std::packaged_task<return_type()>>
-		(std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...));
+	if (stop) throw std::runtime_error("ThreadPool was stopped");
+	Promise<return_type> promise;
+	Future<return_type> res = promise.get_future(get_executor());
+	push(make_packaged_task(std::move(promise),
+		std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...)), priority);
+	return res;
+}
+
+template<typename Fn, typename... Args>
+void ThreadPool::post(Fn&& fn, Args&&... args) {
+	post(Priority::Normal, std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
 
-	std::future<return_type> res = task->get_future();
+template<typename Fn, typename... Args>
+void ThreadPool::post(Priority priority, Fn&& fn, Args&&... args) {
 	if (stop) throw std::runtime_error("ThreadPool was stopped");
-	{
-		std::unique_lock<std::mutex> lock(queue_mutex);
-		tasks.emplace([task](){ (*task)(); });
+	push(std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...), priority);
+}
+
+template<typename Fn, typename... Args>
+bool ThreadPool::try_post(Fn&& fn, Args&&... args) {
+	return try_post(Priority::Normal, std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+template<typename Fn, typename... Args>
+bool ThreadPool::try_post(Priority priority, Fn&& fn, Args&&... args) {
+	if (stop) throw std::runtime_error("ThreadPool was stopped");
+	if (options.capacity && !reserve(1)) {
+		++overflow_count;
+		++reject_count;
+		return false;
 	}
-	condition.notify_one();
+	place(std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...), priority, Clock::time_point());
+	return true;
+}
+
+template<typename Fn, typename... Args>
+void ThreadPool::post_unbounded(Priority priority, Fn&& fn, Args&&... args) {
+	if (stop) throw std::runtime_error("ThreadPool was stopped");
+	if (options.capacity)
+		charge(1);
+	place(std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...), priority, Clock::time_point());
+}
+
+template<typename Fn, typename... Args>
+void ThreadPool::post_by(std::chrono::steady_clock::time_point deadline, Priority priority, Fn&& fn, Args&&... args) {
+	if (stop) throw std::runtime_error("ThreadPool was stopped");
+	push(std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...), priority, deadline);
+}
+
+template<typename It>
+auto ThreadPool::enqueue_bulk(It first, It last)
+-> std::vector<Future<typename std::result_of<
+	typename std::iterator_traits<It>::value_type()>::type>> {
+	typedef typename std::iterator_traits<It>::value_type Fn;
+	using return_type = typename std::result_of<Fn()>::type;
+
+	if (stop) throw std::runtime_error("ThreadPool was stopped");
+	std::vector<Future<return_type>> res;
+	std::vector<TaskFunction> batch;
+	for (; first != last; ++first) {
+		Promise<return_type> promise;
+		res.push_back(promise.get_future(get_executor()));
+		batch.emplace_back(make_packaged_task(std::move(promise), Fn(*first)));
+	}
+	push_bulk(batch);
 	return res;
 }
 
+template<typename It>
+void ThreadPool::post_bulk(It first, It last) {
+	post_bulk(Priority::Normal, first, last);
+}
+
+template<typename It>
+void ThreadPool::post_bulk(Priority priority, It first, It last) {
+	typedef typename std::iterator_traits<It>::value_type Fn;
+
+	if (stop) throw std::runtime_error("ThreadPool was stopped");
+	std::vector<TaskFunction> batch;
+	for (; first != last; ++first)
+		batch.emplace_back(Fn(*first));
+	push_bulk(batch, priority);
+}
+
+template<typename It>
+size_t ThreadPool::try_post_bulk(Priority priority, It first, It last) {
+	return try_post_bulk(priority, first, last, NoDeadline());
+}
+
+template<typename It, typename DeadlineOf>
+size_t ThreadPool::try_post_bulk(Priority priority, It first, It last, DeadlineOf deadline_of) {
+	typedef typename std::iterator_traits<It>::value_type Fn;
+
+	if (stop) throw std::runtime_error("ThreadPool was stopped");
+	size_t n = static_cast<size_t>(std::distance(first, last));
+	if (options.capacity) {
+		size_t fits = reserve(n);
+		if (fits < n) {
+			overflow_count += n - fits;
+			reject_count += n - fits;
+		}
+		n = fits;
+	}
+	std::vector<TaskFunction> batch;
+	std::vector<Clock::time_point> deadlines;
+	batch.reserve(n);
+	deadlines.reserve(n);
+	for (size_t i = 0; i < n; ++i, ++first) {
+		deadlines.push_back(deadline_of(*first));
+		batch.emplace_back(Fn(*first));
+	}
+	place_bulk(batch.data(), batch.size(), priority, deadlines.data());
+	return n;
+}
+
 inline ThreadPool::~ThreadPool()
 {
-	stop = true;
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		stop = true;
+	}
 	condition.notify_all();
-	for (std::thread &worker : workers)
-		worker.join();
+	// Новые потоки после stop не запускаются, поэтому список можно
+	// забрать и дождаться потоков уже без мьютекса.
+	std::vector<std::thread> finishing;
+	{
+		std::lock_guard<std::mutex> lock(workers_mutex);
+		finishing.swap(workers);
+	}
+	for (std::thread &worker : finishing)
+		if (worker.joinable())
+			worker.join();
 }
 
-#endif
\ No newline at end of file
+#endif
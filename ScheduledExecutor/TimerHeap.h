@@ -0,0 +1,158 @@
+#ifndef TIMER_HEAP_H
+#define TIMER_HEAP_H
+
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include "TimerQueue.h"
+
+// Индексированная 4-арная куча таймеров. Ближайший срок всегда в
+// корне, а по идентификатору таймера за O(1) находится его слот и
+// позиция в куче, поэтому постановка, отмена и перенос срока стоят
+// O(log n). Элементы кучи хранят срок рядом с номером слота, чтобы
+// просеивание не ходило за сроком в слоты; 4-арная куча вдвое ниже
+// двоичной и просматривает детей одного узла в соседних ячейках.
+template<typename T, typename TimePoint>
+class TimerHeap : public TimerQueue<T, TimePoint> {
+public:
+	typedef size_t ID;
+
+	bool empty() const override { return heap.empty(); }
+	size_t size() const override { return heap.size(); }
+
+	// Куче не нужно знать текущее время: ближайший таймер всегда в корне.
+	void advance(TimePoint) override { }
+	TimePoint next_deadline() const override { return heap.front().deadline; }
+	bool has_top() const override { return !heap.empty(); }
+	ID top_id() const override { return slots[heap.front().slot].id; }
+	TimePoint top_deadline() const override { return heap.front().deadline; }
+	T & top() override { return slots[heap.front().slot].value; }
+
+	void push(ID id, TimePoint deadline, T value) override {
+		size_t slot;
+		if (free_slots.empty()) {
+			slot = slots.size();
+			slots.emplace_back();
+		} else {
+			slot = free_slots.back();
+			free_slots.pop_back();
+		}
+		slots[slot].value = std::move(value);
+		slots[slot].id = id;
+		slot_of[id] = slot;
+		heap.push_back(Entry {deadline, slot});
+		sift_up(heap.size() - 1);
+	}
+	void reschedule_top(TimePoint deadline) override {
+		heap.front().deadline = deadline;
+		sift_down(0);
+	}
+	void pop() override { remove_at(0); }
+	bool erase(ID id) override {
+		typename std::unordered_map<ID, size_t>::iterator it = slot_of.find(id);
+		if (it == slot_of.end())
+			return false;
+		remove_at(slots[it->second].index);
+		return true;
+	}
+	// Живые элементы сдвигаются к началу, и куча строится заново за O(n).
+	size_t purge(bool (*dead)(T const &)) override {
+		size_t kept = 0;
+		for (size_t i = 0; i < heap.size(); ++i) {
+			Slot & slot = slots[heap[i].slot];
+			if (dead(slot.value)) {
+				slot_of.erase(slot.id);
+				slot.value = T();
+				free_slots.push_back(heap[i].slot);
+			} else {
+				place(kept++, heap[i]);
+			}
+		}
+		size_t removed = heap.size() - kept;
+		heap.resize(kept);
+		if (kept > 1)
+			for (size_t i = (kept - 2) / arity + 1; i-- > 0; )
+				sift_down(i);
+		return removed;
+	}
+	T * find(ID id) override {
+		typename std::unordered_map<ID, size_t>::iterator it = slot_of.find(id);
+		return it == slot_of.end() ? nullptr : &slots[it->second].value;
+	}
+	void clear() override {
+		heap.clear();
+		slots.clear();
+		free_slots.clear();
+		slot_of.clear();
+	}
+private:
+	static const size_t arity = 4;
+
+	struct Entry {
+		TimePoint deadline;
+		size_t slot;
+	};
+	struct Slot {
+		T value;
+		ID id;
+		size_t index;
+	};
+
+	void place(size_t index, Entry const & entry) {
+		heap[index] = entry;
+		slots[entry.slot].index = index;
+	}
+	void sift_up(size_t index) {
+		Entry entry = heap[index];
+		while (index > 0) {
+			size_t parent = (index - 1) / arity;
+			if (!(entry.deadline < heap[parent].deadline))
+				break;
+			place(index, heap[parent]);
+			index = parent;
+		}
+		place(index, entry);
+	}
+	void sift_down(size_t index) {
+		Entry entry = heap[index];
+		size_t n = heap.size();
+		for (;;) {
+			size_t first = index * arity + 1;
+			if (first >= n)
+				break;
+			size_t last = std::min(first + arity, n);
+			size_t best = first;
+			for (size_t child = first + 1; child < last; ++child)
+				if (heap[child].deadline < heap[best].deadline)
+					best = child;
+			if (!(heap[best].deadline < entry.deadline))
+				break;
+			place(index, heap[best]);
+			index = best;
+		}
+		place(index, entry);
+	}
+	void remove_at(size_t index) {
+		size_t slot = heap[index].slot;
+		slot_of.erase(slots[slot].id);
+		// Задача отпускает захваченные ресурсы сразу, а не при повторном
+		// использовании слота.
+		slots[slot].value = T();
+		free_slots.push_back(slot);
+		Entry last = heap.back();
+		heap.pop_back();
+		if (index == heap.size())
+			return;
+		place(index, last);
+		sift_up(index);
+		sift_down(slots[last.slot].index);
+	}
+
+	std::vector<Entry> heap;
+	std::vector<Slot> slots;
+	std::vector<size_t> free_slots;
+	std::unordered_map<ID, size_t> slot_of;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef TIMER_QUEUE_H
+#define TIMER_QUEUE_H
+
+#include <cstddef>
+
+// Очередь таймеров диспетчера ScheduledExecutor. Реализации: TimerHeap
+// (индексированная куча) и TimingWheel (иерархическое колесо).
+// Диспетчер сначала продвигает очередь до текущего времени, затем
+// спрашивает, когда ему проснуться; если этот момент уже наступил,
+// top - таймер, срок которого пришел. Куча показывает ближайший таймер
+// и раньше срока, а колесо - только таймеры, чей тик уже наступил.
+template<typename T, typename TimePoint>
+class TimerQueue {
+public:
+	typedef size_t ID;
+
+	virtual ~TimerQueue() { }
+
+	virtual bool empty() const = 0;
+	virtual size_t size() const = 0;
+
+	// Продвигает внутреннее время очереди до now.
+	virtual void advance(TimePoint now) = 0;
+	// Момент, когда диспетчеру нужно проснуться: не позже срока
+	// ближайшего таймера. Очередь не должна быть пустой.
+	virtual TimePoint next_deadline() const = 0;
+	// Есть ли таймер, который можно посмотреть через top. Всегда true,
+	// если next_deadline() не позже времени, переданного в advance.
+	virtual bool has_top() const = 0;
+	// Ближайший таймер и его точный срок. Вызываются, только если
+	// has_top().
+	virtual ID top_id() const = 0;
+	virtual TimePoint top_deadline() const = 0;
+	virtual T & top() = 0;
+
+	// Идентификатор не должен совпадать ни с одним из таймеров в очереди.
+	virtual void push(ID id, TimePoint deadline, T value) = 0;
+	// Переносит срок таймера top, например на следующий запуск
+	// периодической задачи.
+	virtual void reschedule_top(TimePoint deadline) = 0;
+	virtual void pop() = 0;
+	// Возвращает false, если таймера с таким идентификатором нет.
+	virtual bool erase(ID id) = 0;
+	// Значение таймера или nullptr, если таймера с таким
+	// идентификатором нет.
+	virtual T * find(ID id) = 0;
+	// Удаляет все таймеры, для значений которых dead возвращает true, за
+	// один проход, и возвращает их число.
+	virtual size_t purge(bool (*dead)(T const &)) = 0;
+	virtual void clear() = 0;
+};
+
+#endif
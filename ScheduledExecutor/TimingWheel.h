@@ -0,0 +1,279 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "TimerQueue.h"
+
+// Иерархическое колесо таймеров (Варгезе и Лаук). Время делится на тики
+// длительностью resolution, срок таймера округляется вверх до тика, так
+// что таймер никогда не срабатывает раньше срока, но может опоздать не
+// больше чем на тик. На каждом из levels уровней 2^slot_bits слотов;
+// слот уровня L покрывает 2^(slot_bits * L) тиков. Таймер кладется на
+// самый низкий уровень, где его тик расходится с текущим, а когда время
+// доходит до его слота, перекладывается ниже. Таймеры дальше всех
+// уровней ждут в отдельном списке, который пересматривается при каждом
+// обороте верхнего уровня.
+//
+// Слоты - интрузивные двусвязные списки, поэтому постановка и отмена
+// стоят O(1) и не зависят от числа таймеров. Непустые слоты отмечены в
+// битовых масках, и продвижение времени перескакивает пустые участки,
+// а не проходит тик за тиком.
+template<typename T, typename TimePoint>
+class TimingWheel : public TimerQueue<T, TimePoint> {
+public:
+	typedef size_t ID;
+	typedef typename TimePoint::duration Duration;
+
+	TimingWheel(TimePoint origin, Duration resolution, unsigned slot_bits = 8, unsigned levels = 4)
+		: origin(origin), resolution(resolution), bits(checked_bits(resolution, slot_bits, levels)), levels(levels),
+		slots(size_t(1) << slot_bits), words((slots + 63) / 64), mask(slots - 1),
+		heads(levels * slots + 2, none), occupied(levels * words, 0), current(0), count(0) { }
+
+	bool empty() const override { return count == 0; }
+	size_t size() const override { return count; }
+
+	void advance(TimePoint now) override {
+		if (now < origin)
+			return;
+		uint64_t target = static_cast<uint64_t>((now - origin) / resolution);
+		while (current < target) {
+			uint64_t next = next_event();
+			if (next > target) {
+				current = target;
+				break;
+			}
+			current = next;
+			collect();
+		}
+	}
+	TimePoint next_deadline() const override {
+		if (heads[ready] != none)
+			return time_of(current);
+		return time_of(next_event());
+	}
+	bool has_top() const override { return heads[ready] != none; }
+	ID top_id() const override { return nodes[heads[ready]].id; }
+	TimePoint top_deadline() const override { return nodes[heads[ready]].deadline; }
+	T & top() override { return nodes[heads[ready]].value; }
+
+	void push(ID id, TimePoint deadline, T value) override {
+		size_t n;
+		if (free_nodes.empty()) {
+			n = nodes.size();
+			nodes.emplace_back();
+		} else {
+			n = free_nodes.back();
+			free_nodes.pop_back();
+		}
+		Node & node = nodes[n];
+		node.value = std::move(value);
+		node.id = id;
+		node.deadline = deadline;
+		node.tick = tick_of(deadline);
+		node_of[id] = n;
+		place(n);
+		++count;
+	}
+	void reschedule_top(TimePoint deadline) override {
+		size_t n = heads[ready];
+		unlink(n);
+		nodes[n].deadline = deadline;
+		nodes[n].tick = tick_of(deadline);
+		place(n);
+	}
+	void pop() override { remove(heads[ready]); }
+	bool erase(ID id) override {
+		typename std::unordered_map<ID, size_t>::iterator it = node_of.find(id);
+		if (it == node_of.end())
+			return false;
+		remove(it->second);
+		return true;
+	}
+	T * find(ID id) override {
+		typename std::unordered_map<ID, size_t>::iterator it = node_of.find(id);
+		return it == node_of.end() ? nullptr : &nodes[it->second].value;
+	}
+	size_t purge(bool (*dead)(T const &)) override {
+		std::vector<size_t> found;
+		for (typename std::unordered_map<ID, size_t>::const_iterator it = node_of.begin(); it != node_of.end(); ++it)
+			if (dead(nodes[it->second].value))
+				found.push_back(it->second);
+		for (size_t n : found)
+			remove(n);
+		return found.size();
+	}
+	void clear() override {
+		nodes.clear();
+		free_nodes.clear();
+		node_of.clear();
+		heads.assign(heads.size(), none);
+		occupied.assign(occupied.size(), 0);
+		count = 0;
+	}
+private:
+	static const size_t none = size_t(-1);
+
+	struct Node {
+		T value;
+		ID id;
+		TimePoint deadline;
+		uint64_t tick;
+		size_t prev;
+		size_t next;
+		size_t list;
+	};
+
+	static unsigned checked_bits(Duration resolution, unsigned slot_bits, unsigned levels) {
+		if (resolution <= Duration::zero())
+			throw std::invalid_argument("TimingWheel resolution must be positive.");
+		if (!slot_bits || !levels || slot_bits > 16 || slot_bits * levels >= 64)
+			throw std::invalid_argument("TimingWheel must have 1 to 16 slot bits and less than 64 bits in total.");
+		return slot_bits;
+	}
+	bool is_slot(size_t list) const { return list < levels * slots; }
+	void mark(size_t list, bool busy) {
+		size_t slot = list % slots;
+		uint64_t & word = occupied[list / slots * words + slot / 64];
+		uint64_t bit = uint64_t(1) << (slot % 64);
+		word = busy ? word | bit : word & ~bit;
+	}
+	uint64_t tick_of(TimePoint deadline) const {
+		if (!(origin < deadline))
+			return 0;
+		Duration offset = deadline - origin;
+		return static_cast<uint64_t>((offset + resolution - Duration(1)) / resolution);
+	}
+	TimePoint time_of(uint64_t tick) const {
+		return origin + resolution * static_cast<typename Duration::rep>(tick);
+	}
+	unsigned shift(unsigned level) const { return bits * level; }
+	uint64_t digit(uint64_t tick, unsigned level) const { return (tick >> shift(level)) & mask; }
+
+	// Уровень, на котором тик расходится с текущим, а выше совпадает.
+	void place(size_t n) {
+		uint64_t tick = nodes[n].tick;
+		if (tick <= current) {
+			link(n, ready);
+			return;
+		}
+		for (unsigned level = 0; level < levels; ++level)
+			if ((tick >> shift(level + 1)) == (current >> shift(level + 1))) {
+				link(n, level * slots + digit(tick, level));
+				return;
+			}
+		link(n, overflow);
+	}
+	void link(size_t n, size_t list) {
+		Node & node = nodes[n];
+		node.list = list;
+		node.prev = none;
+		node.next = heads[list];
+		if (node.next != none)
+			nodes[node.next].prev = n;
+		heads[list] = n;
+		if (is_slot(list))
+			mark(list, true);
+	}
+	void unlink(size_t n) {
+		Node & node = nodes[n];
+		if (node.prev != none)
+			nodes[node.prev].next = node.next;
+		else
+			heads[node.list] = node.next;
+		if (node.next != none)
+			nodes[node.next].prev = node.prev;
+		if (heads[node.list] == none && is_slot(node.list))
+			mark(node.list, false);
+	}
+	void remove(size_t n) {
+		unlink(n);
+		node_of.erase(nodes[n].id);
+		// Задача отпускает захваченные ресурсы сразу, а не при повторном
+		// использовании узла.
+		nodes[n].value = T();
+		free_nodes.push_back(n);
+		--count;
+	}
+	// Перекладывает все таймеры списка заново относительно текущего тика.
+	void cascade(size_t list) {
+		size_t n = heads[list];
+		heads[list] = none;
+		if (is_slot(list))
+			mark(list, false);
+		while (n != none) {
+			size_t next = nodes[n].next;
+			place(n);
+			n = next;
+		}
+	}
+	// Вызывается, когда время дошло до тика current: слоты, чей участок
+	// начинается с него, перекладываются вниз, а слот нижнего уровня
+	// переходит в готовые.
+	void collect() {
+		if ((current & ((uint64_t(1) << shift(levels)) - 1)) == 0)
+			cascade(overflow);
+		for (unsigned level = levels - 1; level > 0; --level)
+			if ((current & ((uint64_t(1) << shift(level)) - 1)) == 0)
+				cascade(level * slots + digit(current, level));
+		cascade(digit(current, 0));
+	}
+	// Номер первого непустого слота уровня level, не меньше from, или
+	// slots, если таких нет.
+	size_t next_slot(unsigned level, size_t from) const {
+		if (from >= slots)
+			return slots;
+		uint64_t const * bitmap = &occupied[level * words];
+		size_t word = from / 64;
+		uint64_t bitset = bitmap[word] & (~uint64_t(0) << (from % 64));
+		for (;;) {
+			if (bitset)
+				return word * 64 + __builtin_ctzll(bitset);
+			if (++word == words)
+				return slots;
+			bitset = bitmap[word];
+		}
+	}
+	// Ближайший тик после текущего, на котором что-то происходит:
+	// срабатывает слот нижнего уровня или перекладывается слот выше.
+	// Слоты уровня L всегда раньше слотов уровня L + 1, поэтому поиск
+	// останавливается на первом уровне с непустым слотом впереди.
+	uint64_t next_event() const {
+		for (unsigned level = 0; level < levels; ++level) {
+			size_t slot = next_slot(level, digit(current, level) + 1);
+			if (slot < slots)
+				return ((current >> shift(level + 1)) << shift(level + 1)) | (uint64_t(slot) << shift(level));
+		}
+		if (heads[overflow] != none)
+			return ((current >> shift(levels)) + 1) << shift(levels);
+		return std::numeric_limits<uint64_t>::max();
+	}
+
+	TimePoint origin;
+	Duration resolution;
+	unsigned bits;
+	unsigned levels;
+	size_t slots;
+	size_t words;
+	uint64_t mask;
+	// Списки: сначала слоты всех уровней, затем готовые к запуску и
+	// слишком далекие таймеры.
+	std::vector<size_t> heads;
+	std::vector<uint64_t> occupied;
+	size_t const ready = levels * slots;
+	size_t const overflow = levels * slots + 1;
+	std::vector<Node> nodes;
+	std::vector<size_t> free_nodes;
+	std::unordered_map<ID, size_t> node_of;
+	uint64_t current;
+	size_t count;
+};
+
+template<typename T, typename TimePoint>
+const size_t TimingWheel<T, TimePoint>::none;
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Описание процессоров машины, прочитанное из /sys/devices/system.
+// Если sysfs недоступен, считается, что все hardware_concurrency()
+// процессоров - отдельные ядра одного NUMA-узла.
+class Topology {
+public:
+	struct Cpu {
+		int id;
+		int node;
+		int package;
+		int core;
+		// Порядковый номер среди гиперпотоков одного ядра.
+		int sibling;
+	};
+
+	static Topology const & get() {
+		static Topology topology;
+		return topology;
+	}
+
+	std::vector<Cpu> const & cpus() const { return all; }
+	size_t nodes() const { return node_count; }
+	int node_of(int cpu) const {
+		if (cpu < 0 || static_cast<size_t>(cpu) >= cpu_node.size())
+			return 0;
+		return cpu_node[cpu];
+	}
+	// Узел, на котором сейчас выполняется вызывающий поток.
+	int current_node() const {
+#ifdef __linux__
+		int cpu = sched_getcpu();
+		if (cpu >= 0)
+			return node_of(cpu);
+#endif
+		return 0;
+	}
+
+	// Компактное размещение: соседние потоки на гиперпотоках одного
+	// ядра, затем на соседних ядрах того же узла.
+	std::vector<int> compact() const {
+		std::vector<Cpu> order = compact_cpus();
+		std::vector<int> res;
+		for (Cpu const & cpu : order)
+			res.push_back(cpu.id);
+		return res;
+	}
+	// Разреженное размещение: потоки по очереди раскладываются по узлам
+	// и ядрам, гиперпотоки одного ядра используются в последнюю очередь.
+	std::vector<int> scatter() const {
+		std::vector<Cpu> order = compact_cpus();
+		std::vector<int> rank(order.size());
+		std::vector<int> seen(node_count, 0);
+		for (size_t i = 0; i < order.size(); ++i)
+			if (order[i].sibling == 0)
+				rank[i] = seen[order[i].node]++;
+		for (size_t i = 0; i < order.size(); ++i)
+			if (order[i].sibling != 0)
+				rank[i] = seen[order[i].node]++;
+		std::vector<size_t> index(order.size());
+		for (size_t i = 0; i < index.size(); ++i)
+			index[i] = i;
+		std::stable_sort(index.begin(), index.end(), [&](size_t a, size_t b) {
+			if (rank[a] != rank[b]) return rank[a] < rank[b];
+			return order[a].node < order[b].node;
+		});
+		std::vector<int> res;
+		for (size_t i : index)
+			res.push_back(order[i].id);
+		return res;
+	}
+
+	// Разбирает списки вида "0-3,8,10-11" из sysfs.
+	static std::vector<int> parse_list(std::string const & list) {
+		std::vector<int> res;
+		std::stringstream stream(list);
+		std::string range;
+		while (std::getline(stream, range, ',')) {
+			if (range.empty() || range == "\n")
+				continue;
+			size_t dash = range.find('-');
+			int first = std::stoi(range.substr(0, dash));
+			int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+			for (int cpu = first; cpu <= last; ++cpu)
+				res.push_back(cpu);
+		}
+		return res;
+	}
+
+	// Привязывает вызывающий поток к процессору cpu.
+	static bool pin(int cpu) {
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		(void)cpu;
+		return false;
+#endif
+	}
+private:
+	Topology() : node_count(1) {
+		std::vector<int> online = parse_list(read("/sys/devices/system/cpu/online"));
+		if (online.empty())
+			for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency()); ++i)
+				online.push_back(i);
+		for (int id : online) {
+			std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(id) + "/topology/";
+			Cpu cpu {id, 0, read_int(dir + "physical_package_id", 0), read_int(dir + "core_id", id), 0};
+			std::vector<int> siblings = parse_list(read(dir + "thread_siblings_list"));
+			cpu.sibling = static_cast<int>(std::find(siblings.begin(), siblings.end(), id) - siblings.begin());
+			if (cpu.sibling == static_cast<int>(siblings.size()))
+				cpu.sibling = 0;
+			all.push_back(cpu);
+		}
+		for (int node : parse_list(read("/sys/devices/system/node/online"))) {
+			std::string list = read("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			for (int id : parse_list(list))
+				for (Cpu & cpu : all)
+					if (cpu.id == id)
+						cpu.node = node;
+			node_count = std::max(node_count, static_cast<size_t>(node) + 1);
+		}
+		for (Cpu const & cpu : all) {
+			if (static_cast<size_t>(cpu.id) >= cpu_node.size())
+				cpu_node.resize(cpu.id + 1, 0);
+			cpu_node[cpu.id] = cpu.node;
+		}
+	}
+	static std::string read(std::string const & path) {
+		std::ifstream file(path);
+		std::string line;
+		std::getline(file, line);
+		return line;
+	}
+	static int read_int(std::string const & path, int fallback) {
+		std::string line = read(path);
+		return line.empty() ? fallback : std::stoi(line);
+	}
+	std::vector<Cpu> compact_cpus() const {
+		std::vector<Cpu> order = all;
+		std::sort(order.begin(), order.end(), [](Cpu const & a, Cpu const & b) {
+			if (a.node != b.node) return a.node < b.node;
+			if (a.package != b.package) return a.package < b.package;
+			if (a.core != b.core) return a.core < b.core;
+			return a.id < b.id;
+		});
+		return order;
+	}
+
+	std::vector<Cpu> all;
+	// Узел по номеру процессора: current_node зовется на каждой
+	// постановке, поэтому без поиска по all.
+	std::vector<int> cpu_node;
+	size_t node_count;
+};
+
+#endif
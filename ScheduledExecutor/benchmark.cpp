@@ -0,0 +1,738 @@
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include "ScheduledExecutor.h"
+#include "TaskGraph.h"
+#include "Coroutine.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// Счетчик обращений к куче, чтобы проверять, что задачи ставятся без
+// выделения памяти.
+std::atomic<size_t> allocations {0};
+
+// Операторы не встраиваются: иначе компилятор видит malloc и free
+// за new и delete и предупреждает об их несовпадении.
+__attribute__((noinline)) void * operator new(size_t size) {
+    ++allocations;
+    if (void * p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void * p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void * p, size_t) noexcept {
+    operator delete(p);
+}
+
+// Ждет, пока счетчик выполненных задач не дойдет до expected.
+void waitFor(std::atomic<size_t> & done, size_t expected) {
+    while (done.load() < expected)
+        std::this_thread::yield();
+}
+
+double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void report(std::string const & name, size_t threads, size_t tasks, double seconds) {
+    std::cout << std::left << std::setw(28) << name
+              << " threads = " << std::setw(3) << threads
+              << " tasks/s = " << static_cast<size_t>(tasks / seconds) << std::endl;
+}
+
+// Все задачи ставятся извне пула одним потоком.
+double flatSubmit(ThreadPool::Mode mode, size_t threads, size_t tasks) {
+    std::atomic<size_t> done {0};
+    ThreadPool pool(threads, mode);
+    auto start = Clock::now();
+    for (size_t i = 0; i < tasks; ++i)
+        pool.enqueue([&done] { ++done; });
+    waitFor(done, tasks);
+    return secondsSince(start);
+}
+
+// Каждая задача порождает двух потомков изнутри пула до заданной глубины.
+void spawnTree(ThreadPool & pool, std::atomic<size_t> & done, int depth) {
+    ++done;
+    if (depth == 0)
+        return;
+    pool.enqueue([&pool, &done, depth] { spawnTree(pool, done, depth - 1); });
+    pool.enqueue([&pool, &done, depth] { spawnTree(pool, done, depth - 1); });
+}
+
+double treeSubmit(ThreadPool::Mode mode, size_t threads, int depth) {
+    std::atomic<size_t> done {0};
+    size_t tasks = (size_t(1) << (depth + 1)) - 1;
+    ThreadPool pool(threads, mode);
+    auto start = Clock::now();
+    pool.enqueue([&pool, &done, depth] { spawnTree(pool, done, depth); });
+    waitFor(done, tasks);
+    return secondsSince(start);
+}
+
+void benchWorkStealing() {
+    const size_t flatTasks = 200000;
+    const int depth = 17;
+    const size_t treeTasks = (size_t(1) << (depth + 1)) - 1;
+    size_t maxThreads = std::max<size_t>(std::thread::hardware_concurrency(), 2);
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+        report("flat shared", threads, flatTasks,
+               flatSubmit(ThreadPool::Mode::Shared, threads, flatTasks));
+        report("flat work-stealing", threads, flatTasks,
+               flatSubmit(ThreadPool::Mode::WorkStealing, threads, flatTasks));
+        report("tree shared", threads, treeTasks,
+               treeSubmit(ThreadPool::Mode::Shared, threads, depth));
+        report("tree work-stealing", threads, treeTasks,
+               treeSubmit(ThreadPool::Mode::WorkStealing, threads, depth));
+    }
+}
+
+// Несколько производителей одновременно ставят задачи; меряется среднее
+// время одного вызова enqueue на стороне производителя.
+double submitLatency(ThreadPool::Mode mode, size_t producers, size_t perProducer) {
+    std::atomic<size_t> done {0};
+    std::atomic<long long> submitNs {0};
+    {
+        ThreadPool pool(std::max<size_t>(std::thread::hardware_concurrency(), 2), mode, 1 << 16);
+        std::vector<std::thread> threads;
+        for (size_t p = 0; p < producers; ++p)
+            threads.emplace_back([&] {
+                auto start = Clock::now();
+                for (size_t i = 0; i < perProducer; ++i)
+                    pool.enqueue([&done] { ++done; });
+                submitNs += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+            });
+        for (auto && t : threads)
+            t.join();
+        waitFor(done, producers * perProducer);
+    }
+    return double(submitNs) / (producers * perProducer);
+}
+
+void benchSubmitLatency() {
+    const size_t perProducer = 50000;
+    for (size_t producers = 1; producers <= 8; producers *= 2) {
+        std::cout << "producers = " << producers
+                  << " shared ns/submit = " << submitLatency(ThreadPool::Mode::Shared, producers, perProducer)
+                  << " lock-free ns/submit = " << submitLatency(ThreadPool::Mode::LockFree, producers, perProducer)
+                  << std::endl;
+    }
+}
+
+// Задача с захватом в 16-64 байта ставится и выполняется, а ее результат
+// забирается через get(). После прогрева выделений памяти быть не должно.
+template<size_t Bytes>
+void allocationsPerTask(ThreadPool & pool, size_t tasks) {
+    struct Payload { char data[Bytes]; } payload {};
+    for (size_t i = 0; i < 1000; ++i)
+        pool.enqueue([payload] { return payload.data[0]; }).get();
+    size_t before = allocations;
+    auto start = Clock::now();
+    for (size_t i = 0; i < tasks; ++i)
+        pool.enqueue([payload] { return payload.data[0]; }).get();
+    double seconds = secondsSince(start);
+    std::cout << "capture = " << std::setw(2) << Bytes << " bytes"
+              << " allocations/task = " << double(allocations - before) / tasks
+              << " ns/roundtrip = " << seconds * 1e9 / tasks << std::endl;
+}
+
+void benchAllocations() {
+    ThreadPool pool(2);
+    allocationsPerTask<16>(pool, 100000);
+    allocationsPerTask<32>(pool, 100000);
+    allocationsPerTask<64>(pool, 100000);
+}
+
+// Одна и та же пачка задач ставится четырьмя способами.
+void benchBulkSubmit() {
+    const size_t tasks = 200000;
+    const size_t batch = 256;
+    size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 2);
+    std::atomic<size_t> done {0};
+    std::function<void()> task = [&done] { ++done; };
+    std::vector<std::function<void()>> tasksBatch(batch, task);
+
+    ThreadPool pool(threads);
+    auto start = Clock::now();
+    for (size_t i = 0; i < tasks; ++i)
+        pool.enqueue(task);
+    waitFor(done, tasks);
+    report("enqueue per call", threads, tasks, secondsSince(start));
+
+    done = 0;
+    start = Clock::now();
+    for (size_t i = 0; i < tasks; ++i)
+        pool.post(task);
+    waitFor(done, tasks);
+    report("post per call", threads, tasks, secondsSince(start));
+
+    done = 0;
+    start = Clock::now();
+    for (size_t i = 0; i < tasks; i += batch)
+        pool.enqueue_bulk(tasksBatch.begin(), tasksBatch.end());
+    waitFor(done, tasks / batch * batch);
+    report("enqueue_bulk x256", threads, tasks, secondsSince(start));
+
+    done = 0;
+    start = Clock::now();
+    for (size_t i = 0; i < tasks; i += batch)
+        pool.post_bulk(tasksBatch.begin(), tasksBatch.end());
+    waitFor(done, tasks / batch * batch);
+    report("post_bulk x256", threads, tasks, secondsSince(start));
+}
+
+void spinFor(std::chrono::microseconds duration) {
+    auto end = Clock::now() + duration;
+    while (Clock::now() < end)
+        ;
+}
+
+double percentile(std::vector<double> values, double p) {
+    std::sort(values.begin(), values.end());
+    return values[static_cast<size_t>(p * (values.size() - 1))];
+}
+
+// Полоса Low забита задачами по 20 мкс; раз в миллисекунду ставится
+// проба с приоритетом probe и меряется, сколько она ждет запуска.
+std::vector<double> probeLatency(ThreadPool::Priority probe) {
+    const size_t background = 20000;
+    const size_t probes = 200;
+    ThreadPool pool(std::max<size_t>(std::thread::hardware_concurrency(), 2));
+    std::atomic<size_t> done {0};
+    for (size_t i = 0; i < background; ++i)
+        pool.post(ThreadPool::Priority::Low, [&done] {
+            spinFor(std::chrono::microseconds(20));
+            ++done;
+        });
+    std::vector<double> latencies(probes);
+    for (size_t i = 0; i < probes; ++i) {
+        auto submitted = Clock::now();
+        pool.post(probe, [&latencies, &done, submitted, i] {
+            latencies[i] = std::chrono::duration<double, std::micro>(Clock::now() - submitted).count();
+            ++done;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    waitFor(done, background + probes);
+    return latencies;
+}
+
+void benchPriorityLanes() {
+    std::vector<double> high = probeLatency(ThreadPool::Priority::High);
+    std::vector<double> low = probeLatency(ThreadPool::Priority::Low);
+    std::cout << "high lane probe p50 = " << percentile(high, 0.5)
+              << " us p99 = " << percentile(high, 0.99) << " us" << std::endl;
+    std::cout << "same lane probe p50 = " << percentile(low, 0.5)
+              << " us p99 = " << percentile(low, 0.99) << " us" << std::endl;
+}
+
+// Задачи приходят пачками по 4 с паузой 50 мкс между задачами пачки и
+// 2 мс между пачками; меряется время от постановки до запуска задачи.
+std::vector<double> wakeLatency(ThreadPool::Idle idle) {
+    const size_t bursts = 100;
+    const size_t burst = 4;
+    ThreadPool::Options options;
+    options.threads = 2;
+    options.idle = idle;
+    ThreadPool pool(options);
+    std::vector<double> latencies(bursts * burst);
+    std::atomic<size_t> done {0};
+    for (size_t i = 0; i < latencies.size(); ++i) {
+        auto submitted = Clock::now();
+        pool.post([&latencies, &done, submitted, i] {
+            latencies[i] = std::chrono::duration<double, std::micro>(Clock::now() - submitted).count();
+            ++done;
+        });
+        spinFor(std::chrono::microseconds(50));
+        if (i % burst == burst - 1)
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    waitFor(done, latencies.size());
+    return latencies;
+}
+
+void benchIdleStrategy() {
+    std::vector<double> block = wakeLatency(ThreadPool::Idle::Block);
+    std::vector<double> spin = wakeLatency(ThreadPool::Idle::Spin);
+    std::cout << "block wake p50 = " << percentile(block, 0.5)
+              << " us p99 = " << percentile(block, 0.99) << " us" << std::endl;
+    std::cout << "spin  wake p50 = " << percentile(spin, 0.5)
+              << " us p99 = " << percentile(spin, 0.99) << " us" << std::endl;
+}
+
+// Нижестоящий сервис тормозит: каждая задача ждет 100 мкс, а
+// постановщик ставит задачи без пауз. Для каждой политики видно, сколько
+// задач выполнено, как долго длилась постановка и как часто
+// срабатывало ограничение.
+void benchBackpressure() {
+    const size_t tasks = 20000;
+    const char * names[] = {"block", "caller-runs", "discard", "throw"};
+    ThreadPool::Overflow policies[] = {ThreadPool::Overflow::Block, ThreadPool::Overflow::CallerRuns,
+                                      ThreadPool::Overflow::Discard, ThreadPool::Overflow::Throw};
+    for (size_t p = 0; p < 4; ++p) {
+        ThreadPool::Options options;
+        options.threads = 4;
+        options.capacity = 256;
+        options.overflow = policies[p];
+        ThreadPool pool(options);
+        std::atomic<size_t> done {0};
+        size_t refused = 0;
+        auto start = Clock::now();
+        for (size_t i = 0; i < tasks; ++i) {
+            try {
+                pool.post([&done] { spinFor(std::chrono::microseconds(100)); ++done; });
+            } catch (ThreadPool::QueueFull const &) {
+                ++refused;
+            }
+        }
+        double submit = secondsSince(start);
+        waitFor(done, tasks - pool.rejected());
+        std::cout << std::left << std::setw(12) << names[p]
+                  << " submit ms = " << std::setw(8) << static_cast<size_t>(submit * 1000)
+                  << " ran = " << std::setw(6) << done.load()
+                  << " high water = " << std::setw(4) << pool.high_water()
+                  << " overflows = " << std::setw(6) << pool.overflows()
+                  << " rejected = " << pool.rejected() << std::endl;
+    }
+}
+
+// Цена метрик: пустые задачи, поставленные изнутри пула, с метриками и
+// без, и распределение ожидания и выполнения из снимка.
+void benchMetrics() {
+    const int depth = 17;
+    size_t tasks = (size_t(1) << (depth + 1)) - 1;
+    size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 2);
+    for (int enabled = 0; enabled < 2; ++enabled) {
+        ThreadPool::Options options;
+        options.threads = threads;
+        options.mode = ThreadPool::Mode::WorkStealing;
+        options.metrics = enabled == 1;
+        ThreadPool pool(options);
+        std::atomic<size_t> done {0};
+        auto start = Clock::now();
+        pool.post([&pool, &done, depth] { spawnTree(pool, done, depth); });
+        waitFor(done, tasks);
+        report(enabled ? "metrics on" : "metrics off", threads, tasks, secondsSince(start));
+        if (!enabled)
+            continue;
+        ThreadPool::Metrics metrics = pool.metrics();
+        std::cout << "queue wait p50 = " << metrics.queue_wait.percentile(50)
+                  << " ns p99 = " << metrics.queue_wait.percentile(99)
+                  << " ns; run p50 = " << metrics.run_time.percentile(50)
+                  << " ns p99 = " << metrics.run_time.percentile(99) << " ns" << std::endl;
+    }
+}
+
+// Постановка n таймеров и их отмена в случайном порядке напрямую в
+// структуре, без мьютекса и диспетчера executor-а.
+void timerQueueCost(char const * name, TimerQueue<int, Clock::time_point> & queue, size_t n) {
+    Clock::time_point origin = Clock::now();
+    std::vector<size_t> ids(n);
+    for (size_t i = 0; i < n; ++i)
+        ids[i] = i;
+    std::shuffle(ids.begin(), ids.end(), std::mt19937(7));
+    auto start = Clock::now();
+    for (size_t i = 0; i < n; ++i)
+        queue.push(i, origin + std::chrono::milliseconds(1000 + ids[i] % 100000), 0);
+    double push = secondsSince(start);
+    start = Clock::now();
+    for (size_t id : ids)
+        queue.erase(id);
+    double erase = secondsSince(start);
+    std::cout << std::left << std::setw(6) << name
+              << " raw timers = " << std::setw(9) << n
+              << " push ns = " << std::setw(6) << static_cast<size_t>(push * 1e9 / n)
+              << " erase ns = " << static_cast<size_t>(erase * 1e9 / n) << std::endl;
+}
+
+// Стоимость постановки и отмены при n ожидающих таймерах для кучи и
+// колеса и скорость, с которой диспетчер раздает уже наступившие сроки
+// (не больше миллиона, чтобы не мерить пул).
+void benchTimers() {
+    const char * names[] = {"heap", "wheel"};
+    ScheduledExecutor::Timers backends[] = {ScheduledExecutor::Timers::Heap, ScheduledExecutor::Timers::Wheel};
+    for (size_t n : {size_t(10000), size_t(1000000), size_t(10000000)}) {
+        {
+            TimerHeap<int, Clock::time_point> heap;
+            timerQueueCost("heap", heap, n);
+            TimingWheel<int, Clock::time_point> wheel(Clock::now(), std::chrono::milliseconds(1));
+            timerQueueCost("wheel", wheel, n);
+        }
+        for (size_t b = 0; b < 2; ++b) {
+            ScheduledExecutor::Options options;
+            options.pool.threads = 2;
+            options.timers = backends[b];
+            ScheduledExecutor executor(options);
+            std::vector<ScheduledExecutor::TaskID> ids(n);
+            auto start = Clock::now();
+            for (size_t i = 0; i < n; ++i)
+                ids[i] = executor.ScheduleDelayedTask([] {}, 3600000 + static_cast<long>(i % 100000));
+            double schedule = secondsSince(start);
+            std::shuffle(ids.begin(), ids.end(), std::mt19937(42));
+            start = Clock::now();
+            for (ScheduledExecutor::TaskID id : ids)
+                executor.CancelPeriodicTask(id);
+            double cancel = secondsSince(start);
+            std::vector<ScheduledExecutor::TaskID>().swap(ids);
+
+            size_t due = std::min<size_t>(n, 1000000);
+            std::atomic<size_t> done {0};
+            start = Clock::now();
+            for (size_t i = 0; i < due; ++i)
+                executor.ScheduleDelayedTask([&done] { ++done; }, static_cast<long>(i % 100));
+            waitFor(done, due);
+            double dispatch = secondsSince(start);
+            std::cout << std::left << std::setw(6) << names[b]
+                      << " timers = " << std::setw(9) << n
+                      << " schedule ns = " << std::setw(6) << static_cast<size_t>(schedule * 1e9 / n)
+                      << " cancel ns = " << std::setw(6) << static_cast<size_t>(cancel * 1e9 / n)
+                      << " dispatch timers/s = " << static_cast<size_t>(due / dispatch) << std::endl;
+        }
+    }
+}
+
+// Сэмплер с периодом 10 мс, каждый запуск которого занимает 2 мс.
+// Отклонение - насколько последний запуск ушел от сетки первый
+// запуск + k периодов: при FixedRate оно не растет с числом запусков,
+// при FixedDelay каждый период удлиняется на время выполнения.
+void benchPeriodicDrift() {
+    const size_t runs = 100;
+    const long period = 10;
+    const ScheduledExecutor::Repeat modes[] = { ScheduledExecutor::Repeat::FixedRate,
+                                                ScheduledExecutor::Repeat::FixedDelay };
+    const char * names[] = { "fixed-rate", "fixed-delay" };
+    for (size_t m = 0; m < 2; ++m) {
+        ScheduledExecutor executor(2);
+        std::vector<Clock::time_point> starts(runs);
+        std::atomic<size_t> claimed {0};
+        std::atomic<size_t> done {0};
+        auto id = executor.SchedulePeriodicTask([&starts, &claimed, &done] {
+            size_t i = claimed++;
+            if (i >= runs)
+                return;
+            starts[i] = Clock::now();
+            spinFor(std::chrono::milliseconds(2));
+            ++done;
+        }, 0, period, ThreadPool::Priority::Normal, modes[m]);
+        waitFor(done, runs);
+        executor.CancelPeriodicTask(id);
+        double maxError = 0;
+        for (size_t i = 0; i < runs; ++i) {
+            auto grid = starts[0] + std::chrono::milliseconds(period * static_cast<long>(i));
+            maxError = std::max(maxError, std::chrono::duration<double, std::milli>(starts[i] - grid).count());
+        }
+        auto last = starts[0] + std::chrono::milliseconds(period * static_cast<long>(runs - 1));
+        std::cout << std::left << std::setw(12) << names[m]
+                  << " runs = " << runs << " period ms = " << period
+                  << " final drift ms = " << std::setw(8)
+                  << std::chrono::duration<double, std::milli>(starts[runs - 1] - last).count()
+                  << " max drift ms = " << maxError << std::endl;
+    }
+}
+
+// 2000 однократных задач со сроками, равномерно разбросанными по
+// секунде, с разным slack: сколько раз просыпался диспетчер, сколько
+// пробуждений сэкономлено и насколько запуски опоздали на самом деле.
+void benchTimerSlack() {
+    const size_t timers = 2000;
+    const long span = 1000;
+    const long slacks[] = { 0, 5, 20 };
+    for (long slack : slacks) {
+        ScheduledExecutor executor(2);
+        std::atomic<size_t> done {0};
+        std::mt19937 random(7);
+        std::uniform_int_distribution<long> delay(1, span);
+        for (size_t i = 0; i < timers; ++i)
+            executor.ScheduleDelayedTask([&done] { ++done; }, delay(random),
+                                         ThreadPool::Priority::Normal, slack);
+        waitFor(done, timers);
+        ScheduledExecutor::Metrics metrics = executor.GetMetrics();
+        std::cout << "slack ms = " << std::setw(3) << slack
+                  << " timers = " << timers
+                  << " wakeups = " << std::setw(5) << metrics.wakeups
+                  << " saved = " << std::setw(5) << metrics.coalesced
+                  << " lateness us mean = " << std::setw(8) << static_cast<size_t>(metrics.lateness.mean() / 1000)
+                  << " p99 = " << metrics.lateness.percentile(99) / 1000 << std::endl;
+    }
+}
+
+// Несколько потоков одновременно ставят и отменяют далекие таймеры:
+// пропускная способность schedule + cancel с одним шардом и с шардом на
+// каждого производителя.
+void benchShardedTimers() {
+    const size_t producers = 4;
+    const size_t perProducer = 100000;
+    const size_t shardCounts[] = { 1, producers };
+    for (size_t shardCount : shardCounts) {
+        ScheduledExecutor::Options options;
+        options.pool.threads = 1;
+        options.shards = shardCount;
+        ScheduledExecutor executor(options);
+        auto start = Clock::now();
+        std::vector<std::thread> threads;
+        for (size_t p = 0; p < producers; ++p)
+            threads.emplace_back([&executor] {
+                std::vector<ScheduledExecutor::TaskID> ids(perProducer);
+                for (size_t i = 0; i < perProducer; ++i)
+                    ids[i] = executor.ScheduleDelayedTask([] { }, 3600 * 1000);
+                for (size_t i = 0; i < perProducer; ++i)
+                    executor.CancelPeriodicTask(ids[i]);
+            });
+        for (std::thread & thread : threads)
+            thread.join();
+        double seconds = secondsSince(start);
+        std::cout << "shards = " << shardCount
+                  << " producers = " << producers
+                  << " schedule+cancel ops/s = " << static_cast<size_t>(2 * producers * perProducer / seconds)
+                  << std::endl;
+    }
+}
+
+// Отмена миллиона далеких таймаутов по TaskID, под мьютексом шарда, и
+// по дескрипторам, одним атомарным флагом на задачу.
+void benchCancelHandles() {
+    const size_t n = 1000000;
+    for (int byHandle = 0; byHandle < 2; ++byHandle) {
+        ScheduledExecutor executor(1);
+        std::vector<ScheduledExecutor::TaskHandle> handles;
+        handles.reserve(n);
+        for (size_t i = 0; i < n; ++i)
+            handles.push_back(executor.ScheduleDelayedTask([] { }, 3600 * 1000));
+        auto start = Clock::now();
+        if (byHandle)
+            ScheduledExecutor::CancelTasks(handles.begin(), handles.end());
+        else
+            for (ScheduledExecutor::TaskHandle const & handle : handles)
+                executor.CancelPeriodicTask(handle.Id());
+        double seconds = secondsSince(start);
+        std::cout << "cancel by " << (byHandle ? "handle" : "id    ")
+                  << " timers = " << n
+                  << " cancel ns = " << static_cast<size_t>(seconds * 1e9 / n) << std::endl;
+    }
+}
+
+// Периодическая задача с периодом 10 мс выполняется 25 мс на пуле из
+// одного потока. Concurrent копит запуски в очереди пула, и они
+// опаздывают; Skip и Coalesce держат в пуле не больше одного запуска.
+void benchOverrun() {
+    const ScheduledExecutor::Overrun policies[] = { ScheduledExecutor::Overrun::Concurrent,
+                                                    ScheduledExecutor::Overrun::Skip,
+                                                    ScheduledExecutor::Overrun::Coalesce };
+    const char * names[] = { "concurrent", "skip", "coalesce" };
+    for (size_t p = 0; p < 3; ++p) {
+        ScheduledExecutor executor(1);
+        std::atomic<size_t> runs {0};
+        auto handle = executor.SchedulePeriodicTask([&runs] {
+            spinFor(std::chrono::milliseconds(25));
+            ++runs;
+        }, 0, 10, ThreadPool::Priority::Normal, ScheduledExecutor::Repeat::FixedRate, 0, policies[p]);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        handle.Cancel();
+        std::cout << std::left << std::setw(11) << names[p]
+                  << " runs = " << std::setw(3) << runs.load()
+                  << " skipped = " << std::setw(3) << handle.SkippedRuns()
+                  << " late = " << std::setw(3) << handle.LateRuns()
+                  << " pool queue = " << executor.GetMetrics().pool.depth << std::endl;
+    }
+}
+
+// Периодическая задача с периодом 1 мс: насколько запуск в пуле
+// отклоняется от сетки при ожидании на condition_variable и на
+// timerfd/epoll.
+void benchWaitJitter() {
+    const size_t runs = 1000;
+    const ScheduledExecutor::Wait waits[] = { ScheduledExecutor::Wait::Condition,
+                                              ScheduledExecutor::Wait::Epoll };
+    const char * names[] = { "condvar", "epoll" };
+    for (size_t w = 0; w < 2; ++w) {
+        ScheduledExecutor::Options options;
+        options.pool.threads = 2;
+        options.wait = waits[w];
+        ScheduledExecutor executor(options);
+        std::vector<double> jitter(runs);
+        std::atomic<size_t> claimed {0};
+        std::atomic<size_t> done {0};
+        auto start = Clock::now() + std::chrono::milliseconds(10);
+        auto handle = executor.SchedulePeriodicTask([&jitter, &claimed, &done, start] {
+            size_t i = claimed++;
+            if (i >= runs)
+                return;
+            auto grid = start + std::chrono::milliseconds(static_cast<long>(i));
+            jitter[i] = std::chrono::duration<double, std::micro>(Clock::now() - grid).count();
+            ++done;
+        }, 10, 1);
+        waitFor(done, runs);
+        handle.Cancel();
+        double sum = 0;
+        for (double value : jitter)
+            sum += value;
+        std::cout << std::left << std::setw(8) << names[w]
+                  << " runs = " << runs
+                  << " jitter us mean = " << std::setw(7) << static_cast<long>(sum / runs)
+                  << " p50 = " << std::setw(6) << static_cast<long>(percentile(jitter, 0.5))
+                  << " p99 = " << std::setw(6) << static_cast<long>(percentile(jitter, 0.99))
+                  << " max = " << static_cast<long>(percentile(jitter, 1)) << std::endl;
+    }
+}
+
+// Потребитель ставит ленивую задачу, занимается своей работой и только
+// потом вызывает get(). С предвыборкой задача успевает посчитаться в
+// свободном потоке пула, и get() не ждет.
+void benchLazyPrefetch() {
+    const size_t runs = 200;
+    const ScheduledExecutor::Prefetch modes[] = { ScheduledExecutor::Prefetch::OnDemand,
+                                                  ScheduledExecutor::Prefetch::WhenIdle };
+    const char * names[] = { "on demand", "when idle" };
+    for (size_t m = 0; m < 2; ++m) {
+        ScheduledExecutor executor(2);
+        std::atomic<size_t> computed {0};
+        std::vector<double> wait(runs);
+        for (size_t i = 0; i < runs; ++i) {
+            auto lazy = executor.ScheduleLazyTask(modes[m], [&computed] {
+                spinFor(std::chrono::microseconds(200));
+                return ++computed;
+            });
+            spinFor(std::chrono::microseconds(500));
+            auto start = Clock::now();
+            lazy.get();
+            wait[i] = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+        }
+        std::cout << std::left << std::setw(10) << names[m]
+                  << " runs = " << runs
+                  << " computed = " << computed
+                  << " get us p50 = " << std::setw(6) << static_cast<long>(percentile(wait, 0.5))
+                  << " p99 = " << static_cast<long>(percentile(wait, 0.99)) << std::endl;
+    }
+}
+
+// Смешанная нагрузка в одной полосе одного потока: каждую миллисекунду
+// приходит пачка фоновых задач по 50 мкс со сроком через 50 мс и одна
+// срочная задача со сроком "сейчас". В порядке FIFO срочная ждет всю
+// пачку, при EDF начинается следующей.
+void benchDeadlineOrder() {
+    const size_t rounds = 200;
+    const size_t background = 10;
+    const ThreadPool::Order orders[] = { ThreadPool::Order::Fifo, ThreadPool::Order::Deadline };
+    const char * names[] = { "fifo", "deadline" };
+    for (size_t o = 0; o < 2; ++o) {
+        ThreadPool::Options options;
+        options.threads = 1;
+        options.order = orders[o];
+        options.slo[size_t(ThreadPool::Priority::Normal)] = std::chrono::microseconds(200);
+        ThreadPool pool(options);
+        std::vector<double> lateness(rounds);
+        std::atomic<size_t> done {0};
+        for (size_t i = 0; i < rounds; ++i) {
+            auto now = Clock::now();
+            for (size_t j = 0; j < background; ++j)
+                pool.post_by(now + std::chrono::milliseconds(50), ThreadPool::Priority::Normal,
+                             [] { spinFor(std::chrono::microseconds(50)); });
+            pool.post_by(now, ThreadPool::Priority::Normal, [&lateness, &done, i, now] {
+                lateness[i] = std::chrono::duration<double, std::micro>(Clock::now() - now).count();
+                ++done;
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        waitFor(done, rounds);
+        ThreadPool::Metrics metrics = pool.metrics();
+        std::cout << std::left << std::setw(9) << names[o]
+                  << " urgent lateness us p50 = " << std::setw(6) << static_cast<long>(percentile(lateness, 0.5))
+                  << " p99 = " << std::setw(6) << static_cast<long>(percentile(lateness, 0.99))
+                  << " slo violations = " << metrics.slo_violations[size_t(ThreadPool::Priority::Normal)]
+                  << std::endl;
+    }
+}
+
+double graphNsPerNode(ThreadPool & pool, TaskGraph & graph, size_t runs) {
+    graph.run(pool);
+    auto start = Clock::now();
+    for (size_t i = 0; i < runs; ++i)
+        graph.run(pool);
+    return secondsSince(start) * 1e9 / (runs * graph.size());
+}
+
+// Накладные расходы планирования на узел с пустым телом: широкий граф
+// (исток, 10000 независимых узлов, сток) и глубокий (цепочка из 10000).
+void benchTaskGraph() {
+    const size_t width = 10000;
+    ThreadPool pool(std::max<size_t>(std::thread::hardware_concurrency(), 2));
+
+    TaskGraph wide;
+    TaskGraph::NodeID source = wide.add([] {});
+    TaskGraph::NodeID sink = wide.add([] {});
+    for (size_t i = 0; i < width; ++i) {
+        TaskGraph::NodeID node = wide.add([] {});
+        wide.precede(source, node);
+        wide.precede(node, sink);
+    }
+
+    TaskGraph deep;
+    TaskGraph::NodeID previous = deep.add([] {});
+    for (size_t i = 1; i < width; ++i) {
+        TaskGraph::NodeID node = deep.add([] {});
+        deep.precede(previous, node);
+        previous = node;
+    }
+
+    std::cout << "wide graph ns/node = " << graphNsPerNode(pool, wide, 20) << std::endl;
+    std::cout << "deep graph ns/node = " << graphNsPerNode(pool, deep, 20) << std::endl;
+}
+
+#ifdef __cpp_impl_coroutine
+Task<> sleeper(ScheduledExecutor & executor, std::atomic<size_t> & done, long delay) {
+    co_await executor.sleep_for(delay);
+    ++done;
+}
+
+// Тысячи одновременно спящих сопрограмм обслуживаются пулом из двух
+// потоков: время - задержка плюс расходы на постановку и пробуждение.
+void benchCoroutineSleep() {
+    const size_t coroutines = 10000;
+    const long delay = 200;
+    ScheduledExecutor executor(2);
+    std::atomic<size_t> done {0};
+    auto start = Clock::now();
+    std::vector<Future<void>> results;
+    for (size_t i = 0; i < coroutines; ++i)
+        results.push_back(sleeper(executor, done, delay).start());
+    for (Future<void> & result : results)
+        result.get();
+    std::cout << "coroutines sleeping = " << coroutines
+              << " delay ms = " << delay
+              << " elapsed ms = " << secondsSince(start) * 1000 << std::endl;
+}
+#endif
+
+int main()
+{
+    benchWorkStealing();
+    benchSubmitLatency();
+    benchAllocations();
+    benchBulkSubmit();
+    benchPriorityLanes();
+    benchIdleStrategy();
+    benchBackpressure();
+    benchMetrics();
+    benchTimers();
+    benchPeriodicDrift();
+    benchTimerSlack();
+    benchShardedTimers();
+    benchCancelHandles();
+    benchOverrun();
+    benchWaitJitter();
+    benchLazyPrefetch();
+    benchDeadlineOrder();
+    benchTaskGraph();
+#ifdef __cpp_impl_coroutine
+    benchCoroutineSleep();
+#endif
+    return 0;
+}
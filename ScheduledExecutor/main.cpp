@@ -10,7 +10,7 @@ void printFunction() {
 
 void checkLazyTasks() {
     ScheduledExecutor scheduledExecutorService(4);
-    std::vector< std::future<int> > results;
+    std::vector< Lazy<int> > results;
     
     for(int i = 0; i < 8; ++i) {
         results.emplace_back(
@@ -49,7 +49,7 @@ void checkCombainTasks()
     ScheduledExecutor scheduledExecutorService(4);
     std::cout << "id = " << scheduledExecutorService.SchedulePeriodicTask(printFunction, 0, 1000) << " period = 1000" << std::endl;
     std::cout << "id = " << scheduledExecutorService.ScheduleDelayedTask(printFunction, 0) << " delay = 0" << std::endl;
-    std::vector< std::future<int> > results;
+    std::vector< Lazy<int> > results;
     for(int i = 0; i < 8; ++i) {
         results.emplace_back(
                              scheduledExecutorService.ScheduleLazyTask([i] {
@@ -65,12 +65,59 @@ void checkCombainTasks()
     std::cout << std::endl;
 }
 
+void checkThrowingTasks() {
+    ScheduledExecutor scheduledExecutorService(4);
+    scheduledExecutorService.ScheduleDelayedTask([] { throw std::runtime_error("task failed"); }, 0);
+    scheduledExecutorService.ScheduleDelayedTask(printFunction, 100);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    std::cout << "survived; failed runs = " << scheduledExecutorService.FailedRuns() << std::endl;
+}
+
+void checkCancelById() {
+    for (auto timers : {ScheduledExecutor::Timers::Heap, ScheduledExecutor::Timers::Wheel}) {
+        ScheduledExecutor::Options options;
+        options.pool.threads = 4;
+        options.timers = timers;
+        ScheduledExecutor scheduledExecutorService(options);
+        auto waiting = scheduledExecutorService.SchedulePeriodicTask(printFunction, 1000, 1000);
+        auto running = scheduledExecutorService.SchedulePeriodicTask([] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }, 0, 100, ThreadPool::Priority::Normal, ScheduledExecutor::Repeat::FixedDelay);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        scheduledExecutorService.CancelPeriodicTask(waiting);
+        scheduledExecutorService.CancelPeriodicTask(running);
+        std::cout << "cancelled by id: " << waiting.IsCancelled() << running.IsCancelled()
+                  << "; cancel again: " << waiting.Cancel() << running.Cancel() << std::endl;
+    }
+}
+
+// Пул с Idle::Spin разрушается, пока его потоки еще крутятся после
+// последней задачи: деструктор должен дождаться их выхода, а не зависнуть.
+void checkSpinPoolShutdown() {
+    for (int i = 0; i < 100; ++i) {
+        ThreadPool::Options options;
+        options.threads = 4;
+        options.idle = ThreadPool::Idle::Spin;
+        options.spin_limit = std::chrono::milliseconds(100);
+        ThreadPool pool(options);
+        std::atomic<int> done {0};
+        for (int k = 0; k < 8; ++k)
+            pool.post([&done] { ++done; });
+        while (done < 8)
+            std::this_thread::yield();
+    }
+    std::cout << "spin pool shut down" << std::endl;
+}
+
 int main()
 {
     checkLazyTasks();
     checkPeriodicTasks();
     checkSimpleDelayedTasks();
     checkCombainTasks();
+    checkThrowingTasks();
+    checkCancelById();
+    checkSpinPoolShutdown();
     std::cout << "End" << std::endl;
     return 0;
 }
\ No newline at end of file